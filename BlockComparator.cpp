@@ -0,0 +1,134 @@
+#include <cstring>
+
+#include "BlockComparator.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define BLOCK_COMPARATOR_X86 1
+#include <immintrin.h>
+#endif
+
+typedef BlockComparator::uchar uchar;
+
+bool BlockComparator::GenericEqual(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int blockSize)
+{
+	size_t rowSize = blockSize * 3;
+	for (int y = 0; y < blockSize; y++) {
+		if (std::memcmp(p1 + y * step1, p2 + y * step2, rowSize) != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+#ifdef BLOCK_COMPARATOR_X86
+
+/**
+ * Compare blocks with 16-byte vectors, ORing together the differences of all
+ * rows and testing the result once at the end. Rows which are not a multiple
+ * of 16 bytes are finished with an overlapping load, so the row size must be
+ * at least 16 bytes. This is inlined into callers with a constant block size
+ * so that the loops can be fully unrolled.
+ */
+static inline __attribute__((always_inline))
+bool Sse2EqualImpl(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int blockSize)
+{
+	const int rowSize = blockSize * 3;
+	__m128i diff = _mm_setzero_si128();
+	for (int y = 0; y < blockSize; y++) {
+		const uchar * r1 = p1 + y * step1;
+		const uchar * r2 = p2 + y * step2;
+		int i;
+		for (i = 0; i + 16 <= rowSize; i += 16) {
+			diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + i)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(r2 + i))));
+		}
+		if (i < rowSize) {
+			diff = _mm_or_si128(diff, _mm_xor_si128(
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + rowSize - 16)),
+				_mm_loadu_si128(reinterpret_cast<const __m128i*>(r2 + rowSize - 16))));
+		}
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xffff;
+}
+
+/**
+ * The AVX2 version of Sse2EqualImpl(), for rows of at least 32 bytes
+ */
+static inline __attribute__((always_inline, target("avx2")))
+bool Avx2EqualImpl(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int blockSize)
+{
+	const int rowSize = blockSize * 3;
+	__m256i diff = _mm256_setzero_si256();
+	for (int y = 0; y < blockSize; y++) {
+		const uchar * r1 = p1 + y * step1;
+		const uchar * r2 = p2 + y * step2;
+		int i;
+		for (i = 0; i + 32 <= rowSize; i += 32) {
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(r1 + i)),
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(r2 + i))));
+		}
+		if (i < rowSize) {
+			diff = _mm256_or_si256(diff, _mm256_xor_si256(
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(r1 + rowSize - 32)),
+				_mm256_loadu_si256(reinterpret_cast<const __m256i*>(r2 + rowSize - 32))));
+		}
+	}
+	return _mm256_testz_si256(diff, diff);
+}
+
+template <int blockSize>
+static bool Sse2Equal(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int)
+{
+	return Sse2EqualImpl(p1, step1, p2, step2, blockSize);
+}
+
+static bool Sse2EqualAny(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int blockSize)
+{
+	return Sse2EqualImpl(p1, step1, p2, step2, blockSize);
+}
+
+template <int blockSize>
+__attribute__((target("avx2")))
+static bool Avx2Equal(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int)
+{
+	return Avx2EqualImpl(p1, step1, p2, step2, blockSize);
+}
+
+__attribute__((target("avx2")))
+static bool Avx2EqualAny(const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int blockSize)
+{
+	return Avx2EqualImpl(p1, step1, p2, step2, blockSize);
+}
+
+#endif
+
+BlockComparator::Function BlockComparator::Get(int blockSize) {
+#ifdef BLOCK_COMPARATOR_X86
+	// SSE2 is always available on x86-64, AVX2 must be detected
+	bool avx2 = __builtin_cpu_supports("avx2");
+	switch (blockSize) {
+		case 8:
+			return Sse2Equal<8>;
+		case 16:
+			return avx2 ? Avx2Equal<16> : Sse2Equal<16>;
+		case 32:
+			return avx2 ? Avx2Equal<32> : Sse2Equal<32>;
+	}
+	if (avx2 && blockSize * 3 >= 32) {
+		return Avx2EqualAny;
+	}
+	if (blockSize * 3 >= 16) {
+		return Sse2EqualAny;
+	}
+#endif
+	return GenericEqual;
+}
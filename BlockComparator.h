@@ -0,0 +1,30 @@
+#include <cstddef>
+
+/**
+ * Comparison of square blocks of 3-channel 8-bit pixels for equality. This is
+ * the innermost loop of the motion search, so there are kernels specialised
+ * for common block sizes, using the widest vector instructions supported by
+ * the CPU.
+ */
+class BlockComparator {
+public:
+	typedef unsigned char uchar;
+
+	/**
+	 * A function which compares two blocks with the given top-left pointers
+	 * and row strides in bytes.
+	 */
+	typedef bool (*Function)(const uchar * p1, size_t step1,
+			const uchar * p2, size_t step2, int blockSize);
+
+	/**
+	 * Get the fastest comparison function for the given block size
+	 */
+	static Function Get(int blockSize);
+
+	/**
+	 * A portable comparison function which works for any block size
+	 */
+	static bool GenericEqual(const uchar * p1, size_t step1,
+			const uchar * p2, size_t step2, int blockSize);
+};
@@ -0,0 +1,115 @@
+#include <algorithm>
+#include <climits>
+
+#include "BlockHashIndex.h"
+
+// Multipliers for the polynomial hashes of pixel rows and of row hashes
+static const uint64_t ROW_MULTIPLIER = 0x100000001b3ULL;
+static const uint64_t BLOCK_MULTIPLIER = 0x9e3779b97f4a7c15ULL;
+
+BlockHashIndex::BlockHashIndex(const Mat3b & image, int blockSize) {
+	int xBlockCount = image.cols / blockSize;
+	int positionCount = image.rows - blockSize + 1;
+	if (positionCount <= 0) {
+		m_columns.resize(xBlockCount);
+		return;
+	}
+
+	// Hash each row of each column, row-major so that the image is read
+	// sequentially
+	std::vector<uint64_t> rowHashes((size_t)image.rows * xBlockCount);
+	for (int y = 0; y < image.rows; y++) {
+		const cv::Vec3b * row = image[y];
+		for (int xIndex = 0; xIndex < xBlockCount; xIndex++) {
+			rowHashes[(size_t)xIndex * image.rows + y] =
+				HashRow(row + xIndex * blockSize, blockSize);
+		}
+	}
+
+	// The coefficient of the row leaving the rolling hash
+	uint64_t leadingPower = 1;
+	for (int i = 1; i < blockSize; i++) {
+		leadingPower *= BLOCK_MULTIPLIER;
+	}
+
+	m_columns.resize(xBlockCount);
+	for (int xIndex = 0; xIndex < xBlockCount; xIndex++) {
+		const uint64_t * hashes = &rowHashes[(size_t)xIndex * image.rows];
+		Column & column = m_columns[xIndex];
+		column.resize(positionCount);
+
+		uint64_t blockHash = 0;
+		for (int y = 0; y < blockSize; y++) {
+			blockHash = blockHash * BLOCK_MULTIPLIER + hashes[y];
+		}
+		for (int y = 0; ; y++) {
+			column[y].hash = FoldHash(blockHash);
+			column[y].y = y;
+			if (y + 1 >= positionCount) {
+				break;
+			}
+			blockHash = (blockHash - hashes[y] * leadingPower) * BLOCK_MULTIPLIER
+				+ hashes[y + blockSize];
+		}
+		std::sort(column.begin(), column.end());
+	}
+}
+
+BlockHashIndex::Hash BlockHashIndex::HashBlock(const Mat3b & block) {
+	uint64_t blockHash = 0;
+	for (int y = 0; y < block.rows; y++) {
+		blockHash = blockHash * BLOCK_MULTIPLIER + HashRow(block[y], block.cols);
+	}
+	return FoldHash(blockHash);
+}
+
+uint64_t BlockHashIndex::HashRow(const cv::Vec3b * row, int width) {
+	const unsigned char * bytes = row->val;
+	int length = width * 3;
+	uint64_t hash = 0;
+	for (int i = 0; i < length; i++) {
+		hash = (hash + bytes[i] + 1) * ROW_MULTIPLIER;
+	}
+	return hash;
+}
+
+BlockHashIndex::Hash BlockHashIndex::FoldHash(uint64_t hash) {
+	return static_cast<Hash>(hash ^ (hash >> 32));
+}
+
+BlockHashIndex::OutwardSearch::OutwardSearch(const BlockHashIndex & index,
+		int xIndex, Hash hash, int middle, int window)
+	: m_middle(middle), m_window(window), m_pos(NONE)
+{
+	const Column & column = index.m_columns[xIndex];
+	Entry first = {hash, 0};
+	m_begin = std::lower_bound(column.begin(), column.end(), first);
+	Entry after = {hash, middle};
+	m_after = std::lower_bound(m_begin, column.end(), after);
+	m_before = m_after;
+	Entry last = {hash, INT_MAX};
+	m_end = std::lower_bound(m_after, column.end(), last);
+	next();
+}
+
+const BlockHashIndex::OutwardSearch & BlockHashIndex::OutwardSearch::operator++() {
+	next();
+	return *this;
+}
+
+/**
+ * Advance to the nearer of the two candidates on either side of the middle
+ */
+void BlockHashIndex::OutwardSearch::next() {
+	bool haveAfter = m_after != m_end && m_after->y - m_middle <= m_window;
+	bool haveBefore = m_before != m_begin && m_middle - (m_before - 1)->y <= m_window;
+	if (haveAfter && (!haveBefore || m_after->y - m_middle <= m_middle - (m_before - 1)->y)) {
+		m_pos = m_after->y;
+		++m_after;
+	} else if (haveBefore) {
+		--m_before;
+		m_pos = m_before->y;
+	} else {
+		m_pos = NONE;
+	}
+}
@@ -0,0 +1,87 @@
+#include <opencv2/core/core.hpp>
+#include <vector>
+#include <cstdint>
+
+/**
+ * An index of the hashes of every block in an image whose left edge is
+ * aligned to the block grid, regardless of its vertical position. This allows
+ * a block in one image to be found in the other image by lookup, instead of
+ * by comparing it against every position in the search window.
+ *
+ * Hashes are not unique, so a candidate must be confirmed by comparing the
+ * pixels.
+ */
+class BlockHashIndex {
+public:
+	typedef cv::Mat_<cv::Vec3b> Mat3b;
+	typedef uint32_t Hash;
+
+	BlockHashIndex(const Mat3b & image, int blockSize);
+
+	/**
+	 * Get the hash of a square block, which will be the same as the indexed
+	 * hash of an identical block in the image.
+	 */
+	static Hash HashBlock(const Mat3b & block);
+
+	/**
+	 * Get the hash of a row segment of the given width in pixels
+	 */
+	static uint64_t HashRow(const cv::Vec3b * row, int width);
+
+private:
+	struct Entry {
+		Hash hash;
+		int y;
+
+		bool operator<(const Entry & other) const {
+			return hash < other.hash || (hash == other.hash && y < other.y);
+		}
+	};
+	typedef std::vector<Entry> Column;
+	typedef Column::const_iterator Iterator;
+
+	static Hash FoldHash(uint64_t hash);
+
+	std::vector<Column> m_columns;
+
+public:
+	/**
+	 * Iterate through the vertical positions of the blocks in a given column
+	 * which have a given hash, in the order of an outward search from the
+	 * middle: nearest first, and positive offsets before negative offsets of
+	 * the same distance. Positions further than the window are not visited.
+	 */
+	class OutwardSearch {
+	public:
+		OutwardSearch(const BlockHashIndex & index, int xIndex, Hash hash,
+				int middle, int window);
+
+		const OutwardSearch & operator++();
+
+		operator bool() {
+			return m_pos != NONE;
+		}
+
+		int offset() const {
+			return m_pos - m_middle;
+		}
+
+		int pos() const {
+			return m_pos;
+		}
+
+	private:
+		enum {NONE = -1};
+
+		void next();
+
+		int m_middle;
+		int m_window;
+		Iterator m_begin;
+		Iterator m_after;
+		Iterator m_before;
+		Iterator m_end;
+		int m_pos;
+	};
+};
@@ -1,83 +1,207 @@
-#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include "BlockMotionSearch.h"
-#include "OutwardAlternatingSearch.h"
+#include "RowAlignment.h"
+#include "ThreadCpuTime.h"
 
+/**
+ * Search for the motion of each block. Each block depends on the results for
+ * the block to its left and the block above it, so with multiple threads,
+ * rows are interleaved between threads, and each thread waits for the row
+ * above to get ahead of it. The result does not depend on the number of
+ * threads.
+ */
 BlockMotionSearch::Mat1i BlockMotionSearch::search() {
 	int yBlockCount = m_source.rows / m_blockSize;
 	int xBlockCount = m_source.cols / m_blockSize;
 	m_blockMotion = Mat1i(yBlockCount, xBlockCount);
+	m_alignedMotion.assign(yBlockCount, NOT_FOUND);
+	if (m_options.alignRows) {
+		alignRows();
+	}
 
-	for (m_yIndex = 0; m_yIndex < yBlockCount; m_yIndex++) {
-		m_y = m_yIndex * m_blockSize;
-		for (m_xIndex = 0; m_xIndex < xBlockCount; m_xIndex++) {
-			m_x = m_xIndex * m_blockSize;
-			cv::Rect sourceRect(m_x, m_y, m_blockSize, m_blockSize);
-			Mat3b sourceBlock = m_source(sourceRect);
+	if (std::count(m_alignedMotion.begin(), m_alignedMotion.end(), NOT_FOUND) > 0) {
+		m_destIndex.reset(new BlockHashIndex(m_dest, m_blockSize));
+	}
+	m_rowProgress.reset(new std::atomic<int>[yBlockCount]);
+	for (int yIndex = 0; yIndex < yBlockCount; yIndex++) {
+		m_rowProgress[yIndex] = 0;
+	}
 
-			// Priority 1: exactly constant baseline
-			if (m_xIndex > 0 && m_blockMotion(m_yIndex, m_xIndex - 1) != NOT_FOUND) {
-				if (tryMotion(sourceBlock, m_blockMotion(m_yIndex, m_xIndex - 1))) {
-					continue;
-				}
-			}
+	int threads = std::max(1, std::min(m_options.threads, yBlockCount));
+	m_threadCounters.assign(threads, SearchCounters());
+	std::vector<double> cpuTimes(threads, 0);
+	std::vector<std::thread> workers;
+	for (int i = 1; i < threads; i++) {
+		workers.emplace_back([this, i, threads, &cpuTimes] {
+			double start = GetThreadCpuTime();
+			searchRows(i, threads, m_threadCounters[i]);
+			cpuTimes[i] = GetThreadCpuTime() - start;
+		});
+	}
+	searchRows(0, threads, m_threadCounters[0]);
+	for (auto & worker : workers) {
+		worker.join();
+	}
+	for (double cpuTime : cpuTimes) {
+		m_workerCpuTime += cpuTime;
+	}
+	if (m_cancelled) {
+		throw std::runtime_error("The deadline was exceeded");
+	}
+	return m_blockMotion;
+}
 
-			int searchStart;
-			if (m_yIndex > 0 && m_blockMotion(m_yIndex - 1, m_xIndex) != NOT_FOUND) {
-				// Priority 2: near-constant vertical flow
-				searchStart = m_y + m_blockMotion(m_yIndex - 1, m_xIndex);
-			} else if (m_xIndex > 0 && m_blockMotion(m_yIndex, m_xIndex - 1) != NOT_FOUND) {
-				// Priority 3: near-constant baseline
-				searchStart = m_y + m_blockMotion(m_yIndex, m_xIndex - 1);
-			} else {
-				// Priority 4: source offset
-				searchStart = m_y;
-			}
-			// Check bounds of searchStart
-			if (searchStart > m_dest.rows - m_blockSize) {
-				searchStart = m_dest.rows - m_blockSize;
-			}
-			if (searchStart < 0) {
-				searchStart = 0;
+/**
+ * Find rows of blocks in which every pixel row has the same motion in the
+ * alignment of full-width rows. Every block in such a row of blocks matches at
+ * that offset, so no search is needed.
+ */
+void BlockMotionSearch::alignRows() {
+	std::vector<int> rowMotion = RowAlignment::Align(m_source, m_dest);
+	for (int yIndex = 0; yIndex < (int)m_alignedMotion.size(); yIndex++) {
+		int y = yIndex * m_blockSize;
+		int dy = rowMotion[y];
+		for (int i = 1; i < m_blockSize && dy != NOT_FOUND; i++) {
+			if (rowMotion[y + i] != dy) {
+				dy = NOT_FOUND;
 			}
+		}
+		m_alignedMotion[yIndex] = dy;
+	}
+}
 
-			// Make sure the search window includes the no-change case
-			int tempWindowSize = std::max(std::abs(searchStart - m_y), m_windowSize);
-
-			OutwardAlternatingSearch search(searchStart, m_dest.rows - m_blockSize + 1,
-					tempWindowSize);
-			m_blockMotion(m_yIndex, m_xIndex) = NOT_FOUND;
-			for (; search; ++search) {
-				if (tryMotion(sourceBlock, search.pos() - m_y)) {
-					break;
+void BlockMotionSearch::searchRows(int firstRow, int rowStep, SearchCounters & counters) {
+	int yBlockCount = m_blockMotion.rows;
+	int xBlockCount = m_blockMotion.cols;
+	for (int yIndex = firstRow; yIndex < yBlockCount; yIndex += rowStep) {
+		if (std::chrono::steady_clock::now() >= m_options.deadline) {
+			m_cancelled = true;
+		}
+		if (m_cancelled) {
+			return;
+		}
+		for (int xIndex = 0; xIndex < xBlockCount; xIndex++) {
+			// Wait for the block above
+			if (yIndex > 0) {
+				while (m_rowProgress[yIndex - 1].load(std::memory_order_acquire) <= xIndex) {
+					if (m_cancelled) {
+						return;
+					}
+					std::this_thread::yield();
 				}
 			}
+			if (!m_options.cleanBlocks.empty() && m_options.cleanBlocks(yIndex, xIndex)) {
+				m_blockMotion(yIndex, xIndex) = 0;
+				counters.cleanBlocks++;
+			} else if (m_alignedMotion[yIndex] != NOT_FOUND) {
+				m_blockMotion(yIndex, xIndex) = m_alignedMotion[yIndex];
+				counters.alignedBlocks++;
+			} else {
+				long long probes = counters.probes;
+				m_blockMotion(yIndex, xIndex) = searchBlock(xIndex, yIndex, counters);
+				probes = counters.probes - probes;
+				if (m_options.probeBudget > 0
+					&& m_probes.fetch_add(probes) + probes > m_options.probeBudget)
+				{
+					m_degraded = true;
+				}
+			}
+			m_rowProgress[yIndex].store(xIndex + 1, std::memory_order_release);
 		}
 	}
-	return m_blockMotion;
 }
 
-bool BlockMotionSearch::tryMotion(const Mat3b & sourceBlock, int dy) {
-	cv::Rect destRect(m_x, m_y + dy, m_blockSize, m_blockSize);
-	Mat3b destBlock = m_dest(destRect);
-	if (blockEqual(sourceBlock, destBlock)) {
-		m_blockMotion(m_yIndex, m_xIndex) = dy;
-		return true;
+int BlockMotionSearch::searchBlock(int xIndex, int yIndex, SearchCounters & counters) {
+	int x = xIndex * m_blockSize;
+	int y = yIndex * m_blockSize;
+	cv::Rect sourceRect(x, y, m_blockSize, m_blockSize);
+	Mat3b sourceBlock = m_source(sourceRect);
+	counters.searchedBlocks++;
+
+	// Priority 1: exactly constant baseline
+	if (xIndex > 0 && m_blockMotion(yIndex, xIndex - 1) != NOT_FOUND) {
+		if (tryMotion(sourceBlock, x, y, m_blockMotion(yIndex, xIndex - 1), counters)) {
+			counters.priorityHits[SearchCounters::CONSTANT_BASELINE]++;
+			return m_blockMotion(yIndex, xIndex - 1);
+		}
+	}
+
+	int searchStart;
+	SearchCounters::Priority priority;
+	if (yIndex > 0 && m_blockMotion(yIndex - 1, xIndex) != NOT_FOUND) {
+		// Priority 2: near-constant vertical flow
+		searchStart = y + m_blockMotion(yIndex - 1, xIndex);
+		priority = SearchCounters::VERTICAL_FLOW;
+	} else if (xIndex > 0 && m_blockMotion(yIndex, xIndex - 1) != NOT_FOUND) {
+		// Priority 3: near-constant baseline
+		searchStart = y + m_blockMotion(yIndex, xIndex - 1);
+		priority = SearchCounters::NEAR_BASELINE;
 	} else {
-		return false;
+		// Priority 4: source offset
+		searchStart = y;
+		priority = SearchCounters::SOURCE_OFFSET;
+	}
+	// Check bounds of searchStart
+	if (searchStart > m_dest.rows - m_blockSize) {
+		searchStart = m_dest.rows - m_blockSize;
+	}
+	if (searchStart < 0) {
+		searchStart = 0;
 	}
-}
 
-bool BlockMotionSearch::blockEqual(const Mat3b & m1, const Mat3b & m2) {
-	if (m1.size() != m2.size()) {
-		return false;
+	// Once the budget is exceeded, try only the predicted position, so that
+	// the cost of each remaining block is bounded
+	if (m_degraded) {
+		counters.degradedBlocks++;
+		// The near baseline was already tried as the constant baseline
+		if (priority != SearchCounters::NEAR_BASELINE
+			&& tryMotion(sourceBlock, x, y, searchStart - y, counters))
+		{
+			counters.priorityHits[priority]++;
+			counters.addDistance(0);
+			return searchStart - y;
+		}
+		counters.notFoundBlocks++;
+		return NOT_FOUND;
 	}
-	int rowSize = m1.cols * m1.elemSize();
-	for (int y = 0; y < m1.rows; y++) {
-		if (std::memcmp(m1.ptr(y), m2.ptr(y), rowSize) != 0) {
-			return false;
+
+	// Make sure the search window includes the no-change case
+	int tempWindowSize = std::max(std::abs(searchStart - y), m_windowSize);
+
+	// Only positions where the destination block has the same hash can
+	// match, so look them up in the index instead of trying every
+	// position in the window
+	BlockHashIndex::OutwardSearch search(*m_destIndex, xIndex,
+			BlockHashIndex::HashBlock(sourceBlock), searchStart, tempWindowSize);
+	for (; search; ++search) {
+		counters.candidates++;
+		if (tryMotion(sourceBlock, x, y, search.pos() - y, counters)) {
+			counters.priorityHits[priority]++;
+			counters.addDistance(std::abs(search.offset()));
+			return search.pos() - y;
 		}
 	}
-	return true;
+	counters.notFoundBlocks++;
+	return NOT_FOUND;
 }
 
+bool BlockMotionSearch::tryMotion(const Mat3b & sourceBlock, int x, int y, int dy,
+		SearchCounters & counters)
+{
+	counters.probes++;
+	cv::Rect destRect(x, y + dy, m_blockSize, m_blockSize);
+	Mat3b destBlock = m_dest(destRect);
+	return blockEqual(sourceBlock, destBlock);
+}
+
+/**
+ * Compare two blocks of size m_blockSize
+ */
+bool BlockMotionSearch::blockEqual(const Mat3b & m1, const Mat3b & m2) {
+	return m_blockEqual(m1.ptr(), m1.step, m2.ptr(), m2.step, m_blockSize);
+}
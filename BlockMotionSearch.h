@@ -1,38 +1,110 @@
 #include <opencv2/core/core.hpp>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "BlockHashIndex.h"
+#include "BlockComparator.h"
+#include "SearchCounters.h"
 
 class BlockMotionSearch {
 public:
+	typedef unsigned char uchar;
 	typedef cv::Mat_<cv::Vec3b> Mat3b;
 	typedef cv::Mat_<int> Mat1i;
+	typedef cv::Mat_<uchar> Mat1b;
 
 	enum {NOT_FOUND = 0x7fffffff};
 
+	struct Options {
+		int blockSize = 16;
+		int windowSize = 200;
+		int threads = 1;
+		bool alignRows = true;
+
+		// Blocks which are known to be unchanged, and so have zero motion
+		// without searching. This is optional.
+		Mat1b cleanBlocks;
+
+		// The number of probes after which the search degrades, trying only
+		// the predicted motion of each remaining block, or zero for no limit
+		long long probeBudget = 0;
+
+		// If this time is reached, the search stops and Search() throws a
+		// std::runtime_error
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::time_point::max();
+	};
+
+	/**
+	 * Find the motion of each block. If counters is given, the work done by
+	 * the search is added to it. If workerCpuTime is given, the CPU time in
+	 * milliseconds of the threads other than the calling thread is added to
+	 * it.
+	 */
 	static Mat1i Search(const Mat3b & alice, const Mat3b & bob,
-			int blockSize, int windowSize)
+			const Options & options, SearchCounters * counters = nullptr,
+			double * workerCpuTime = nullptr)
 	{
-		BlockMotionSearch obj(alice, bob, blockSize, windowSize);
-		return obj.search();
+		BlockMotionSearch obj(alice, bob, options);
+		Mat1i motion = obj.search();
+		if (counters) {
+			for (const SearchCounters & threadCounters : obj.m_threadCounters) {
+				counters->add(threadCounters);
+			}
+		}
+		if (workerCpuTime) {
+			*workerCpuTime += obj.m_workerCpuTime;
+		}
+		return motion;
 	}
 
 private:
 
 	BlockMotionSearch(const Mat3b & alice, const Mat3b & bob,
-			int blockSize, int windowSize)
-		: m_source(alice), m_dest(bob), m_blockSize(blockSize), m_windowSize(windowSize)
+			const Options & options)
+		: m_source(alice), m_dest(bob), m_options(options),
+		m_blockSize(options.blockSize), m_windowSize(options.windowSize),
+		m_blockEqual(BlockComparator::Get(options.blockSize)),
+		m_cancelled(false), m_probes(0), m_degraded(false), m_workerCpuTime(0)
 	{}
 
 	Mat1i search();
-	bool tryMotion(const Mat3b & sourceBlock, int dy);
+	void alignRows();
+	void searchRows(int firstRow, int rowStep, SearchCounters & counters);
+	int searchBlock(int xIndex, int yIndex, SearchCounters & counters);
+	bool tryMotion(const Mat3b & sourceBlock, int x, int y, int dy,
+			SearchCounters & counters);
 	bool blockEqual(const Mat3b & m1, const Mat3b & m2);
 
 	const Mat3b & m_source;
 	const Mat3b & m_dest;
+	const Options & m_options;
 	Mat1i m_blockMotion;
 	const int m_blockSize;
 	const int m_windowSize;
+	std::unique_ptr<BlockHashIndex> m_destIndex;
+	BlockComparator::Function m_blockEqual;
 
-	int m_xIndex, m_yIndex, m_x, m_y;
-};
+	// The motion of each row of blocks which was found by row alignment, or
+	// NOT_FOUND if the row of blocks needs to be searched
+	std::vector<int> m_alignedMotion;
+
+	// The number of blocks completed in each row, for synchronisation between
+	// threads
+	std::unique_ptr<std::atomic<int>[]> m_rowProgress;
 
+	// Set when the deadline has passed, to stop all threads
+	std::atomic<bool> m_cancelled;
 
+	// The probes of all threads, counted after each block, and whether they
+	// have exceeded the budget
+	std::atomic<long long> m_probes;
+	std::atomic<bool> m_degraded;
 
+	// The counters of each thread, which are added when the search is done
+	std::vector<SearchCounters> m_threadCounters;
+
+	// The total CPU time of the worker threads in milliseconds
+	double m_workerCpuTime;
+};
@@ -0,0 +1,100 @@
+#include <utility>
+#include <vector>
+#include "MotionValue.h"
+
+/**
+ * A counted multiset of the motion values under a brush. As the brush slides
+ * by one pixel, or as pixels under it are painted, it is updated in constant
+ * time, instead of rescanning the whole brush to find its consensus.
+ *
+ * T is the element type of the motion field.
+ */
+template <typename T>
+class ConsensusTracker {
+public:
+	static constexpr T NOT_FOUND = MotionValue<T>::NOT_FOUND;
+	static constexpr T INVALID = MotionValue<T>::INVALID;
+
+	ConsensusTracker()
+		: m_size(0), m_notFoundCount(0)
+	{}
+
+	void add(T value);
+	void remove(T value);
+
+	void replace(T oldValue, T newValue) {
+		if (oldValue != newValue) {
+			remove(oldValue);
+			add(newValue);
+		}
+	}
+
+	/**
+	 * Get the value of all elements in the brush, or INVALID if they are not
+	 * all the same.
+	 */
+	T getStrongConsensus() const {
+		if (m_notFoundCount == m_size) {
+			return NOT_FOUND;
+		} else if (m_notFoundCount == 0 && m_counts.size() == 1) {
+			return m_counts[0].first;
+		} else {
+			return INVALID;
+		}
+	}
+
+	/**
+	 * Determine whether all elements in the brush are NOT_FOUND
+	 */
+	bool isNotFound() const {
+		return m_notFoundCount == m_size;
+	}
+
+private:
+	int m_size;
+	int m_notFoundCount;
+
+	// The distinct values other than NOT_FOUND, with their counts. There are
+	// few enough of them that a linear search is fastest.
+	std::vector<std::pair<T, int>> m_counts;
+};
+
+template <typename T>
+constexpr T ConsensusTracker<T>::NOT_FOUND;
+
+template <typename T>
+constexpr T ConsensusTracker<T>::INVALID;
+
+template <typename T>
+inline void ConsensusTracker<T>::add(T value) {
+	m_size++;
+	if (value == NOT_FOUND) {
+		m_notFoundCount++;
+		return;
+	}
+	for (auto & entry : m_counts) {
+		if (entry.first == value) {
+			entry.second++;
+			return;
+		}
+	}
+	m_counts.push_back(std::make_pair(value, 1));
+}
+
+template <typename T>
+inline void ConsensusTracker<T>::remove(T value) {
+	m_size--;
+	if (value == NOT_FOUND) {
+		m_notFoundCount--;
+		return;
+	}
+	for (size_t i = 0; i < m_counts.size(); i++) {
+		if (m_counts[i].first == value) {
+			if (--m_counts[i].second == 0) {
+				m_counts[i] = m_counts.back();
+				m_counts.pop_back();
+			}
+			return;
+		}
+	}
+}
@@ -0,0 +1,338 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "UprightDiff.h"
+#include "ImageWriter.h"
+#include "DiffServer.h"
+#include "JsonFormat.h"
+
+static std::runtime_error SystemError(const std::string & message) {
+	return std::runtime_error(message + ": " + strerror(errno));
+}
+
+DiffServer::~DiffServer() {
+	stop();
+	if (m_listenFd >= 0) {
+		close(m_listenFd);
+	}
+	if (m_bound) {
+		unlink(m_options.socketPath.c_str());
+	}
+}
+
+void DiffServer::run() {
+	// Write errors are reported by write(), so a client which disconnects
+	// should not kill the server
+	signal(SIGPIPE, SIG_IGN);
+	listen();
+
+	int jobs = std::max(1, m_options.jobs);
+	for (int i = 0; i < jobs; i++) {
+		m_workers.emplace_back(&DiffServer::work, this);
+	}
+
+	for (;;) {
+		int fd = accept(m_listenFd, nullptr, nullptr);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			std::runtime_error error = SystemError("Unable to accept a connection");
+			stop();
+			throw error;
+		}
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_notFull.wait(lock, [this] {
+			return (int)m_queue.size() < std::max(1, m_options.queueSize);
+		});
+		m_queue.push_back(fd);
+		m_notEmpty.notify_one();
+	}
+}
+
+/**
+ * Create the listening socket, replacing any stale socket left at the path.
+ * If another server is listening on the path, an error is thrown.
+ */
+void DiffServer::listen() {
+	const std::string & path = m_options.socketPath;
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+		throw std::runtime_error("The socket path is empty or too long");
+	}
+	strcpy(address.sun_path, path.c_str());
+
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		// A socket which refuses connections was left by a server which
+		// exited without removing it
+		int probeFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (probeFd < 0) {
+			throw SystemError("Unable to create a socket");
+		}
+		int result = connect(probeFd, (sockaddr*)&address, sizeof(address));
+		int connectErrno = errno;
+		close(probeFd);
+		if (result == 0) {
+			throw std::runtime_error("Another server is listening on \"" + path + "\"");
+		}
+		if (connectErrno != ECONNREFUSED) {
+			errno = connectErrno;
+			throw SystemError("Unable to check the existing socket \"" + path + "\"");
+		}
+		unlink(path.c_str());
+	}
+
+	m_listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listenFd < 0) {
+		throw SystemError("Unable to create a socket");
+	}
+	if (bind(m_listenFd, (sockaddr*)&address, sizeof(address)) < 0) {
+		throw SystemError("Unable to bind to \"" + path + "\"");
+	}
+	m_bound = true;
+	if (::listen(m_listenFd, SOMAXCONN) < 0) {
+		throw SystemError("Unable to listen on \"" + path + "\"");
+	}
+}
+
+/**
+ * Stop the workers, closing any connections which have not been served
+ */
+void DiffServer::stop() {
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+		for (int fd : m_queue) {
+			close(fd);
+		}
+		m_queue.clear();
+	}
+	m_notEmpty.notify_all();
+	for (auto & worker : m_workers) {
+		worker.join();
+	}
+	m_workers.clear();
+}
+
+void DiffServer::work() {
+	Scratch scratch(m_options.writerOptions);
+	for (;;) {
+		int fd;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notEmpty.wait(lock, [this] {
+				return m_stopping || !m_queue.empty();
+			});
+			if (m_stopping) {
+				return;
+			}
+			fd = m_queue.front();
+			m_queue.pop_front();
+			m_notFull.notify_one();
+		}
+		serveConnection(fd, scratch);
+	}
+}
+
+void DiffServer::serveConnection(int fd, Scratch & scratch) {
+	Connection connection(fd);
+	if (m_options.idleTimeout > 0) {
+		// A read which times out fails with EAGAIN, which closes the connection
+		timeval timeout;
+		timeout.tv_sec = m_options.idleTimeout / 1000;
+		timeout.tv_usec = (m_options.idleTimeout % 1000) * 1000;
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	}
+	std::string line;
+	bool keepOpen = true;
+	while (keepOpen && connection.readLine(line)) {
+		std::string response = handleRequest(connection, line, scratch, keepOpen);
+		if (!connection.write(response + "\n")) {
+			break;
+		}
+	}
+}
+
+/**
+ * Handle a request, and get the response. If the connection can no longer be
+ * used, keepOpen is set to false.
+ */
+std::string DiffServer::handleRequest(Connection & connection,
+		const std::string & line, Scratch & scratch, bool & keepOpen)
+{
+	std::vector<std::string> fields;
+	std::istringstream lineStream(line);
+	std::string field;
+	while (std::getline(lineStream, field, '\t')) {
+		fields.push_back(field);
+	}
+	if (!line.empty() && line[line.size() - 1] == '\t') {
+		fields.push_back("");
+	}
+
+	try {
+		std::string destName;
+		if (fields.size() == 3) {
+			scratch.alice = cv::imread(fields[0]);
+			scratch.bob = cv::imread(fields[1]);
+			destName = fields[2];
+		} else if (fields.size() == 4 && fields[0] == "INLINE") {
+			char * end1;
+			char * end2;
+			unsigned long aliceSize = strtoul(fields[1].c_str(), &end1, 10);
+			unsigned long bobSize = strtoul(fields[2].c_str(), &end2, 10);
+			if (fields[1].empty() || *end1 || fields[2].empty() || *end2
+				|| aliceSize > MAX_INLINE_SIZE || bobSize > MAX_INLINE_SIZE)
+			{
+				// The images which follow cannot be skipped
+				keepOpen = false;
+				throw std::runtime_error("Invalid inline image size");
+			}
+			if (!connection.readBytes(scratch.encodedAlice, aliceSize)
+				|| !connection.readBytes(scratch.encodedBob, bobSize))
+			{
+				keepOpen = false;
+				throw std::runtime_error("Unexpected end of inline image data");
+			}
+			// On failure, imdecode() leaves the destination unchanged, so it
+			// would still hold the previous request's image
+			scratch.alice.release();
+			scratch.bob.release();
+			cv::imdecode(scratch.encodedAlice, cv::IMREAD_COLOR, &scratch.alice);
+			if (scratch.alice.empty()) {
+				throw std::runtime_error("Unable to decode the first inline image");
+			}
+			cv::imdecode(scratch.encodedBob, cv::IMREAD_COLOR, &scratch.bob);
+			if (scratch.bob.empty()) {
+				throw std::runtime_error("Unable to decode the second inline image");
+			}
+			destName = fields[3];
+		} else {
+			throw std::runtime_error("Invalid request");
+		}
+
+		UprightDiff::Options diffOptions = m_options.diffOptions;
+		diffOptions.statsOnly = destName.empty();
+		if (m_options.deadline > 0) {
+			diffOptions.deadline = std::chrono::steady_clock::now()
+				+ std::chrono::milliseconds(m_options.deadline);
+		}
+		Logger logger(std::cerr, diffOptions.logLevel, diffOptions.logTimestamp);
+		if (diffOptions.stripHeight > 0) {
+			diffOptions.stripWriter = [&](const cv::Mat & strip, int y, const cv::Size & size) {
+				scratch.writer.writeStrip(destName, strip, y, size, logger);
+			};
+		}
+		UprightDiff::Output & output = scratch.output;
+		UprightDiff::Diff(scratch.alice, scratch.bob, diffOptions, output, scratch.context);
+		if (!destName.empty() && diffOptions.stripHeight == 0) {
+			scratch.writer.write(destName, output.visual, logger);
+		}
+		return "{" + JsonFormat::FormatStats(output) + "," +
+			JsonFormat::FormatTimings(output) + "}";
+	} catch (std::exception & e) {
+		// Remove the output of a diff which failed while writing strips
+		scratch.writer.abandonStrips();
+		std::string message = e.what();
+		while (!message.empty() && message[message.size() - 1] == '\n') {
+			message.erase(message.size() - 1);
+		}
+		return "{\"error\":" + JsonFormat::FormatString(message) + "}";
+	}
+}
+
+DiffServer::Connection::~Connection() {
+	close(m_fd);
+}
+
+/**
+ * Read a line, without the line ending. Return false at the end of the
+ * input.
+ */
+bool DiffServer::Connection::readLine(std::string & line) {
+	line.clear();
+	for (;;) {
+		// After a read which fills the buffer, m_start may be at its end
+		char * start = m_buffer.data() + m_start;
+		char * newline = (char*)memchr(start, '\n', m_end - m_start);
+		if (newline) {
+			line.append(start, newline);
+			m_start += newline - start + 1;
+			if (!line.empty() && line[line.size() - 1] == '\r') {
+				line.erase(line.size() - 1);
+			}
+			return true;
+		}
+		line.append(start, m_end - m_start);
+		m_start = m_end;
+		if (line.size() > MAX_LINE_SIZE || !fill()) {
+			return false;
+		}
+	}
+}
+
+bool DiffServer::Connection::readBytes(std::vector<uchar> & bytes, size_t size) {
+	bytes.resize(size);
+	size_t done = 0;
+	while (done < size) {
+		if (m_start == m_end && !fill()) {
+			return false;
+		}
+		size_t length = std::min(size - done, m_end - m_start);
+		memcpy(&bytes[done], &m_buffer[m_start], length);
+		m_start += length;
+		done += length;
+	}
+	return true;
+}
+
+bool DiffServer::Connection::write(const std::string & data) {
+	size_t done = 0;
+	while (done < data.size()) {
+		ssize_t result = ::write(m_fd, data.data() + done, data.size() - done);
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		done += result;
+	}
+	return true;
+}
+
+/**
+ * Replace the consumed buffer contents with more input. Return false at the
+ * end of the input, or on error.
+ */
+bool DiffServer::Connection::fill() {
+	m_start = m_end = 0;
+	for (;;) {
+		ssize_t result = read(m_fd, &m_buffer[0], m_buffer.size());
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result <= 0) {
+			return false;
+		}
+		m_end = result;
+		return true;
+	}
+}
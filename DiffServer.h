@@ -0,0 +1,135 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * A server which keeps a warm process for diffing images on request, over a
+ * Unix domain socket.
+ *
+ * A client may send any number of requests on a connection. Each request is a
+ * line, which either names the files to use:
+ *
+ *     <input-1> TAB <input-2> TAB <output> LF
+ *
+ * or gives the sizes of two encoded images, which follow the line:
+ *
+ *     INLINE TAB <size-1> TAB <size-2> TAB <output> LF
+ *
+ * The output may be empty, in which case only the statistics are calculated.
+ * Each request is answered with a line of JSON, containing either the
+ * statistics or an error.
+ *
+ * A worker serves one connection until it is closed, so idle connections are
+ * closed after a timeout, to stop them from holding every worker.
+ */
+class DiffServer {
+public:
+	typedef unsigned char uchar;
+
+	struct Options {
+		std::string socketPath;
+
+		// The number of connections served at once
+		int jobs = 1;
+
+		// The number of accepted connections which may wait for a worker
+		int queueSize = 16;
+
+		// The time limit for each request in milliseconds, or zero for none
+		int deadline = 0;
+
+		// The time in milliseconds after which a connection on which nothing
+		// is received is closed, freeing its worker, or zero for no limit
+		int idleTimeout = 10000;
+
+		UprightDiff::Options diffOptions;
+		ImageWriter::Options writerOptions;
+	};
+
+	DiffServer(const Options & options)
+		: m_options(options), m_listenFd(-1), m_bound(false), m_stopping(false)
+	{}
+
+	~DiffServer();
+
+	/**
+	 * Listen for connections and serve them. This only returns by throwing a
+	 * std::runtime_error.
+	 */
+	void run();
+
+private:
+	enum {
+		// The maximum size of a request line
+		MAX_LINE_SIZE = 65536,
+		// The maximum size of an inline image
+		MAX_INLINE_SIZE = 1 << 28
+	};
+
+	/**
+	 * The buffers kept by each worker between requests, so that they are not
+	 * reallocated for each request of a similar size
+	 */
+	struct Scratch {
+		Scratch(const ImageWriter::Options & writerOptions)
+			: writer(writerOptions)
+		{}
+
+		std::vector<uchar> encodedAlice;
+		std::vector<uchar> encodedBob;
+		cv::Mat alice;
+		cv::Mat bob;
+		UprightDiff::Context context;
+		UprightDiff::Output output;
+		ImageWriter writer;
+	};
+
+	/**
+	 * A buffered client connection
+	 */
+	class Connection {
+	public:
+		Connection(int fd)
+			: m_fd(fd), m_start(0), m_end(0), m_buffer(65536)
+		{}
+
+		~Connection();
+
+		bool readLine(std::string & line);
+		bool readBytes(std::vector<uchar> & bytes, size_t size);
+		bool write(const std::string & data);
+
+	private:
+		bool fill();
+
+		int m_fd;
+		size_t m_start;
+		size_t m_end;
+		std::vector<char> m_buffer;
+	};
+
+	void listen();
+	void stop();
+	void work();
+	void serveConnection(int fd, Scratch & scratch);
+	std::string handleRequest(Connection & connection, const std::string & line,
+			Scratch & scratch, bool & keepOpen);
+
+	const Options & m_options;
+	int m_listenFd;
+
+	// True if the socket file was created by this server, so it should be
+	// removed on exit
+	bool m_bound;
+	std::vector<std::thread> m_workers;
+
+	// The accepted connections waiting for a worker
+	std::mutex m_mutex;
+	std::condition_variable m_notEmpty;
+	std::condition_variable m_notFull;
+	std::deque<int> m_queue;
+	bool m_stopping;
+};
@@ -0,0 +1,260 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <png.h>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#include "Logger.h"
+#include "ImageWriter.h"
+
+/**
+ * A PNG file which is being written in strips
+ */
+struct ImageWriter::PngStream {
+	std::string name;
+	FILE * file = nullptr;
+	png_structp png = nullptr;
+	png_infop info = nullptr;
+
+	// The number of rows written
+	int rows = 0;
+
+	// The time spent encoding and writing the strips
+	std::chrono::duration<double, std::milli> elapsed{0};
+
+	~PngStream() {
+		if (png) {
+			png_destroy_write_struct(&png, &info);
+		}
+		if (file) {
+			fclose(file);
+		}
+	}
+};
+
+// libpng reports errors by jumping back to the last setjmp(), so the calls
+// are made from these functions, which have no objects to destroy
+
+static bool StartPng(png_structp png, png_infop info, FILE * file,
+		const cv::Size & size, int compression, int strategy)
+{
+	if (setjmp(png_jmpbuf(png))) {
+		return false;
+	}
+	png_init_io(png, file);
+	png_set_IHDR(png, info, size.width, size.height, 8, PNG_COLOR_TYPE_RGB,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	if (compression >= 0) {
+		png_set_compression_level(png, compression);
+	}
+	if (strategy >= 0) {
+		// The cv::IMWRITE_PNG_STRATEGY constants are the zlib strategies
+		png_set_compression_strategy(png, strategy);
+	}
+	png_write_info(png, info);
+	// The rows are in OpenCV's BGR order
+	png_set_bgr(png);
+	return true;
+}
+
+static bool WritePngRows(png_structp png, const cv::Mat & rows) {
+	if (setjmp(png_jmpbuf(png))) {
+		return false;
+	}
+	for (int y = 0; y < rows.rows; y++) {
+		png_write_row(png, rows.ptr(y));
+	}
+	return true;
+}
+
+static bool FinishPng(png_structp png, png_infop info) {
+	if (setjmp(png_jmpbuf(png))) {
+		return false;
+	}
+	png_write_end(png, info);
+	return true;
+}
+
+ImageWriter::ImageWriter(const Options & options)
+	: m_options(options)
+{}
+
+ImageWriter::~ImageWriter() {
+	abandonStrips();
+}
+
+void ImageWriter::write(const std::string & name, const cv::Mat & image, Logger & logger) {
+	std::string extension = getExtension(name);
+	std::vector<int> params;
+	if (extension == ".png") {
+		if (m_options.pngCompression >= 0) {
+			params.push_back(cv::IMWRITE_PNG_COMPRESSION);
+			params.push_back(m_options.pngCompression);
+		}
+		if (m_options.pngStrategy >= 0) {
+			params.push_back(cv::IMWRITE_PNG_STRATEGY);
+			params.push_back(m_options.pngStrategy);
+		}
+	} else if (extension == ".webp") {
+		// A quality above 100 selects lossless compression
+		params.push_back(cv::IMWRITE_WEBP_QUALITY);
+		params.push_back(101);
+	} else if (extension == ".ppm") {
+		params.push_back(cv::IMWRITE_PXM_BINARY);
+		params.push_back(1);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	bool encoded;
+	try {
+		encoded = cv::imencode(extension, image, m_buffer, params);
+	} catch (cv::Exception & e) {
+		encoded = false;
+	}
+	if (!encoded) {
+		throw std::runtime_error("Unable to encode the output image \"" + name + "\"");
+	}
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	logger.log(Logger::INFO) << "Encoded " << extension.substr(1) << " output in " <<
+		elapsed.count() << " ms, " << m_buffer.size() << " bytes\n";
+
+	std::ofstream file(name, std::ios::binary | std::ios::trunc);
+	file.write((const char*)m_buffer.data(), m_buffer.size());
+	file.close();
+	if (!file) {
+		throw std::runtime_error("Unable to write the output image \"" + name + "\"");
+	}
+}
+
+void ImageWriter::writeStrip(const std::string & name, const cv::Mat & strip, int y,
+		const cv::Size & size, Logger & logger)
+{
+	auto start = std::chrono::steady_clock::now();
+	if (y == 0) {
+		abandonStrips();
+		if (getExtension(name) != ".png") {
+			throw std::runtime_error("The output image \"" + name +
+				"\" must be PNG to be written in strips");
+		}
+		m_pngStream.reset(new PngStream);
+		PngStream & stream = *m_pngStream;
+		stream.name = name;
+		stream.file = fopen(name.c_str(), "wb");
+		if (!stream.file) {
+			m_pngStream.reset();
+			throw std::runtime_error("Unable to write the output image \"" + name + "\"");
+		}
+		stream.png = png_create_write_struct(PNG_LIBPNG_VER_STRING,
+				nullptr, nullptr, nullptr);
+		if (stream.png) {
+			stream.info = png_create_info_struct(stream.png);
+		}
+		if (!stream.info || !StartPng(stream.png, stream.info, stream.file, size,
+				m_options.pngCompression, m_options.pngStrategy))
+		{
+			abandonStrips();
+			throw std::runtime_error("Unable to encode the output image \"" + name + "\"");
+		}
+	} else if (!m_pngStream || m_pngStream->name != name || m_pngStream->rows != y) {
+		throw std::runtime_error("The strips of the output image \"" + name +
+			"\" are out of order");
+	}
+
+	PngStream & stream = *m_pngStream;
+	if (strip.type() != CV_8UC3 || strip.cols != size.width
+		|| stream.rows + strip.rows > size.height
+		|| !WritePngRows(stream.png, strip))
+	{
+		abandonStrips();
+		throw std::runtime_error("Unable to encode the output image \"" + name + "\"");
+	}
+	stream.rows += strip.rows;
+	if (stream.rows < size.height) {
+		stream.elapsed += std::chrono::steady_clock::now() - start;
+		return;
+	}
+
+	bool finished = FinishPng(stream.png, stream.info);
+	long bytes = ftell(stream.file);
+	finished = fclose(stream.file) == 0 && finished && bytes >= 0;
+	stream.file = nullptr;
+	if (!finished) {
+		abandonStrips();
+		throw std::runtime_error("Unable to write the output image \"" + name + "\"");
+	}
+	stream.elapsed += std::chrono::steady_clock::now() - start;
+	logger.log(Logger::INFO) << "Encoded png output in strips in " <<
+		stream.elapsed.count() << " ms, " << bytes << " bytes\n";
+	m_pngStream.reset();
+}
+
+void ImageWriter::abandonStrips() {
+	if (m_pngStream) {
+		std::string name = m_pngStream->name;
+		m_pngStream.reset();
+		std::remove(name.c_str());
+	}
+}
+
+/**
+ * Get the extension which selects the encoder, including the dot
+ */
+std::string ImageWriter::getExtension(const std::string & name) const {
+	switch (m_options.format) {
+		case PNG:
+			return ".png";
+		case WEBP:
+			return ".webp";
+		case PPM:
+			return ".ppm";
+		case BMP:
+			return ".bmp";
+		default:
+			break;
+	}
+	size_t dot = name.rfind('.');
+	if (dot == std::string::npos || name.find('/', dot) != std::string::npos) {
+		throw std::runtime_error("The output image \"" + name + "\" has no extension");
+	}
+	std::string extension = name.substr(dot);
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension;
+}
+
+bool ImageWriter::ParseFormat(const std::string & name, Format & format) {
+	if (name == "auto") {
+		format = AUTO;
+	} else if (name == "png") {
+		format = PNG;
+	} else if (name == "webp") {
+		format = WEBP;
+	} else if (name == "ppm") {
+		format = PPM;
+	} else if (name == "bmp") {
+		format = BMP;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+bool ImageWriter::ParsePngStrategy(const std::string & name, int & strategy) {
+	if (name == "default") {
+		strategy = cv::IMWRITE_PNG_STRATEGY_DEFAULT;
+	} else if (name == "filtered") {
+		strategy = cv::IMWRITE_PNG_STRATEGY_FILTERED;
+	} else if (name == "huffman") {
+		strategy = cv::IMWRITE_PNG_STRATEGY_HUFFMAN_ONLY;
+	} else if (name == "rle") {
+		strategy = cv::IMWRITE_PNG_STRATEGY_RLE;
+	} else if (name == "fixed") {
+		strategy = cv::IMWRITE_PNG_STRATEGY_FIXED;
+	} else {
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,89 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Encoding and writing of the visual output, with control over the format
+ * and the trade-off between encoding time and size
+ */
+class ImageWriter {
+public:
+	typedef unsigned char uchar;
+
+	enum Format {
+		// Use the format given by the file extension
+		AUTO,
+		PNG,
+		// Lossless WebP
+		WEBP,
+		// Binary PPM, which is not compressed
+		PPM,
+		BMP
+	};
+
+	struct Options {
+		Format format = AUTO;
+
+		// The PNG compression level from 0 to 9, or -1 for the library default.
+		// Lower levels are faster and larger.
+		int pngCompression = -1;
+
+		// The zlib strategy for PNG, one of the cv::IMWRITE_PNG_STRATEGY
+		// constants, or -1 for the library default
+		int pngStrategy = -1;
+	};
+
+	ImageWriter(const Options & options);
+
+	/**
+	 * Abandon any image which is partly written by writeStrip()
+	 */
+	~ImageWriter();
+
+	/**
+	 * Encode an image and write it to a file, logging the encoding time.
+	 * Throws std::runtime_error on failure.
+	 */
+	void write(const std::string & name, const cv::Mat & image, Logger & logger);
+
+	/**
+	 * Encode and write one strip of an image which is produced in strips,
+	 * such as by a diff with a strip height. The strips must be given in
+	 * order, starting at row zero. The first strip creates the file, and the
+	 * strip which reaches the given height finishes it, logging the encoding
+	 * time. Only PNG can be written in strips. Throws std::runtime_error on
+	 * failure.
+	 */
+	void writeStrip(const std::string & name, const cv::Mat & strip, int y,
+			const cv::Size & size, Logger & logger);
+
+	/**
+	 * Abandon an image which is partly written by writeStrip(), removing the
+	 * file
+	 */
+	void abandonStrips();
+
+	/**
+	 * Parse a format name, returning false if it is not valid
+	 */
+	static bool ParseFormat(const std::string & name, Format & format);
+
+	/**
+	 * Parse a PNG strategy name, returning false if it is not valid
+	 */
+	static bool ParsePngStrategy(const std::string & name, int & strategy);
+
+private:
+	struct PngStream;
+
+	std::string getExtension(const std::string & name) const;
+
+	const Options & m_options;
+
+	// The encoded image, kept so that a writer used for many images does not
+	// reallocate it
+	std::vector<uchar> m_buffer;
+
+	// The image being written by writeStrip(), or null
+	std::unique_ptr<PngStream> m_pngStream;
+};
@@ -0,0 +1,113 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <stdexcept>
+
+#include "MotionValue.h"
+#include "IntermediateWriter.h"
+
+IntermediateWriter::IntermediateWriter(const std::string & dir, int queueSize)
+	: m_dir(dir), m_queueSize(std::max(1, queueSize)), m_finishing(false)
+{
+	m_thread = std::thread(&IntermediateWriter::run, this);
+}
+
+IntermediateWriter::~IntermediateWriter() {
+	try {
+		finish();
+	} catch (std::runtime_error & e) {
+	}
+}
+
+void IntermediateWriter::write(const std::string & label, const cv::Mat & image) {
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_notFull.wait(lock, [this] {
+		return (int)m_queue.size() < m_queueSize;
+	});
+	m_queue.emplace_back(label, image);
+	m_notEmpty.notify_one();
+}
+
+void IntermediateWriter::finish() {
+	if (!m_thread.joinable()) {
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_finishing = true;
+	}
+	m_notEmpty.notify_one();
+	m_thread.join();
+	if (!m_error.empty()) {
+		throw std::runtime_error(m_error);
+	}
+}
+
+void IntermediateWriter::run() {
+	for (;;) {
+		std::pair<std::string, cv::Mat> item;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_notEmpty.wait(lock, [this] {
+				return m_finishing || !m_queue.empty();
+			});
+			if (m_queue.empty()) {
+				return;
+			}
+			item = std::move(m_queue.front());
+			m_queue.pop_front();
+			m_notFull.notify_one();
+		}
+		// imwrite() returns false if the file could not be opened, for
+		// example if the directory does not exist
+		bool written;
+		try {
+			cv::Mat out = ConvertIntermediate(item.second);
+			written = cv::imwrite(m_dir + "/" + item.first + ".png", out);
+		} catch (cv::Exception & e) {
+			written = false;
+		}
+		if (!written && m_error.empty()) {
+			m_error = "Unable to write the intermediate image \"" + item.first + "\"";
+		}
+	}
+}
+
+/**
+ * Convert a motion field to a viewable image. Other images are unchanged.
+ */
+cv::Mat IntermediateWriter::ConvertIntermediate(const cv::Mat & m) {
+	if (m.type() == CV_16S) {
+		return ConvertMotion(cv::Mat_<int16_t>(m));
+	} else if (m.type() == CV_32S) {
+		return ConvertMotion(cv::Mat_<int>(m));
+	} else {
+		return m;
+	}
+}
+
+/**
+ * Show the motion as a blend of blue and red, and NOT_FOUND as white
+ */
+template <typename T>
+cv::Mat IntermediateWriter::ConvertMotion(const cv::Mat_<T> & motion) {
+	cv::Mat_<cv::Vec3b> out(motion.size());
+	for (int y = 0; y < motion.rows; y++) {
+		for (int x = 0; x < motion.cols; x++) {
+			int dy = motion(y, x);
+			cv::Vec3b color;
+			if (dy == MotionValue<T>::NOT_FOUND) {
+				color = cv::Vec3b(255, 255, 255);
+			} else {
+				if (dy < -127) {
+					dy = -127;
+				} else if (dy > 127) {
+					dy = 127;
+				}
+				color = cv::Vec3b(128 + dy, 0, 128 - dy);
+			}
+			out(y, x) = color;
+		}
+	}
+	return out;
+}
@@ -0,0 +1,52 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * A background thread which converts intermediate images for viewing and
+ * writes them as PNG files, so that debug output does not stall the
+ * pipeline. The images are shared with the caller, so an image must not be
+ * modified after it is queued.
+ */
+class IntermediateWriter {
+public:
+	IntermediateWriter(const std::string & dir, int queueSize = 4);
+
+	/**
+	 * Stop the thread, discarding any error
+	 */
+	~IntermediateWriter();
+
+	/**
+	 * Queue an image to be written as <label>.png. This waits if the queue
+	 * is full.
+	 */
+	void write(const std::string & label, const cv::Mat & image);
+
+	/**
+	 * Wait for the queued images to be written, and stop the thread. If an
+	 * image could not be encoded or written, a std::runtime_error is thrown.
+	 */
+	void finish();
+
+private:
+	void run();
+	static cv::Mat ConvertIntermediate(const cv::Mat & m);
+
+	template <typename T>
+	static cv::Mat ConvertMotion(const cv::Mat_<T> & motion);
+
+	std::string m_dir;
+	int m_queueSize;
+	std::thread m_thread;
+
+	std::mutex m_mutex;
+	std::condition_variable m_notEmpty;
+	std::condition_variable m_notFull;
+	std::deque<std::pair<std::string, cv::Mat>> m_queue;
+	bool m_finishing;
+	std::string m_error;
+};
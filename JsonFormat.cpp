@@ -0,0 +1,75 @@
+#include <opencv2/core/core.hpp>
+#include <iomanip>
+#include <sstream>
+
+#include "UprightDiff.h"
+#include "JsonFormat.h"
+
+std::string JsonFormat::FormatStats(const UprightDiff::Output & output) {
+	std::ostringstream buf;
+	buf <<
+		"\"totalArea\":" << output.totalArea << "," <<
+		"\"modifiedArea\":" << output.maskArea << "," <<
+		"\"movedArea\":" << output.movedArea << "," <<
+		"\"residualArea\":" << output.residualArea << "," <<
+		"\"searchDegraded\":" << (output.search.degradedBlocks ? "true" : "false") << "," <<
+		"\"search\":" << FormatSearchCounters(output.search);
+	return buf.str();
+}
+
+std::string JsonFormat::FormatSearchCounters(const SearchCounters & counters) {
+	std::ostringstream buf;
+	buf << "{" <<
+		"\"cleanBlocks\":" << counters.cleanBlocks << "," <<
+		"\"alignedBlocks\":" << counters.alignedBlocks << "," <<
+		"\"searchedBlocks\":" << counters.searchedBlocks << "," <<
+		"\"notFoundBlocks\":" << counters.notFoundBlocks << "," <<
+		"\"degradedBlocks\":" << counters.degradedBlocks << "," <<
+		"\"probes\":" << counters.probes << "," <<
+		"\"candidates\":" << counters.candidates << "," <<
+		"\"priorityHits\":{" <<
+		"\"constantBaseline\":" << counters.priorityHits[SearchCounters::CONSTANT_BASELINE] << "," <<
+		"\"verticalFlow\":" << counters.priorityHits[SearchCounters::VERTICAL_FLOW] << "," <<
+		"\"nearBaseline\":" << counters.priorityHits[SearchCounters::NEAR_BASELINE] << "," <<
+		"\"sourceOffset\":" << counters.priorityHits[SearchCounters::SOURCE_OFFSET] << "}," <<
+		"\"distanceHistogram\":[";
+	int end = SearchCounters::DISTANCE_BUCKETS;
+	while (end > 0 && counters.distanceHistogram[end - 1] == 0) {
+		end--;
+	}
+	for (int i = 0; i < end; i++) {
+		buf << (i ? "," : "") << counters.distanceHistogram[i];
+	}
+	buf << "]}";
+	return buf.str();
+}
+
+std::string JsonFormat::FormatTimings(const UprightDiff::Output & output) {
+	std::ostringstream buf;
+	buf << "\"timings\":{\"stages\":{";
+	for (size_t i = 0; i < output.timings.size(); i++) {
+		const UprightDiff::Output::StageTiming & timing = output.timings[i];
+		buf << (i ? "," : "") << FormatString(timing.stage) << ":{" <<
+			"\"wallTime\":" << timing.wallTime << "," <<
+			"\"cpuTime\":" << timing.cpuTime << "}";
+	}
+	buf << "},\"peakBufferBytes\":" << output.peakBufferBytes << "}";
+	return buf.str();
+}
+
+std::string JsonFormat::FormatString(const std::string & s) {
+	std::ostringstream buf;
+	buf << '"';
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			buf << '\\' << c;
+		} else if (c < 0x20) {
+			buf << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c
+				<< std::dec;
+		} else {
+			buf << c;
+		}
+	}
+	buf << '"';
+	return buf.str();
+}
@@ -0,0 +1,32 @@
+#include <string>
+#include "UprightDiff.h"
+
+/**
+ * Formatting of the diff statistics as JSON, for the command line and the
+ * server
+ */
+class JsonFormat {
+public:
+	/**
+	 * Format the statistics as the members of a JSON object, without the
+	 * braces, so that other members can be added
+	 */
+	static std::string FormatStats(const UprightDiff::Output & output);
+
+	/**
+	 * Format the search counters as a JSON object. The histogram is written
+	 * without its trailing empty buckets.
+	 */
+	static std::string FormatSearchCounters(const SearchCounters & counters);
+
+	/**
+	 * Format the stage timings and the peak buffer size as a "timings"
+	 * member, without a leading comma
+	 */
+	static std::string FormatTimings(const UprightDiff::Output & output);
+
+	/**
+	 * Format a string as a quoted and escaped JSON string
+	 */
+	static std::string FormatString(const std::string & s);
+};
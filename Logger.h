@@ -1,5 +1,5 @@
 #include <ostream>
-#include <ctime>
+#include <chrono>
 #include <sstream>
 #include <iomanip>
 
@@ -8,7 +8,9 @@ public:
 	Logger(std::ostream & backend, int level, bool showTimestamp = false)
 		: m_level(level), m_showTimestamp(showTimestamp),
 		m_realStream(backend, true), m_devNull(backend, false)
-	{}
+	{
+		GetStartTime();
+	}
 
 	enum {TRACE, DEBUG, INFO, WARNING, ERROR, FATAL};
 
@@ -44,9 +46,13 @@ public:
 		}
 	}
 
+	/**
+	 * Get the wall time since the first logger was created. This is not CPU
+	 * time, which would count the time of every thread.
+	 */
 	std::string timestamp() {
-		std::clock_t now = clock();
-		std::clock_t totalMillis = now / (CLOCKS_PER_SEC / 1000);
+		long long totalMillis = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - GetStartTime()).count();
 
 		std::ostringstream buf;
 		buf << std::setw(3) << (totalMillis / 1000) << "."
@@ -56,6 +62,12 @@ public:
 	}
 
 private:
+	static std::chrono::steady_clock::time_point GetStartTime() {
+		static const std::chrono::steady_clock::time_point start =
+			std::chrono::steady_clock::now();
+		return start;
+	}
+
 	int m_level;
 	bool m_showTimestamp;
 	LogStream m_realStream;
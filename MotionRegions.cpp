@@ -0,0 +1,205 @@
+#include <algorithm>
+
+#include "MotionValue.h"
+#include "MotionRegions.h"
+
+/**
+ * Label the regions in one raster scan. Each pixel takes the label of an
+ * equal neighbour to the left or above, and if both are present, their
+ * labels are merged. The statistics of each provisional label are then
+ * combined into its region.
+ *
+ * A merge keeps the lower label as the root, and a region's lowest label is
+ * the one created at its first pixel, so ordering the roots by label gives
+ * the regions in raster order.
+ *
+ * The labels may share the motion field, so each row's motion is copied
+ * before its labels are written, and kept for comparison with the next row.
+ */
+template <typename T>
+MotionRegions::MotionRegions(cv::Mat_<T> motion, cv::Mat * labelBuffer)
+	: m_labels(GetLabelStorage(motion, labelBuffer))
+{
+	findRegions(motion);
+}
+
+template <typename T>
+MotionRegions MotionRegions::FindWithoutLabels(const cv::Mat_<T> & motion) {
+	MotionRegions regions;
+	regions.findRegions(motion);
+	return regions;
+}
+
+/**
+ * Find the regions, storing the labels in m_labels if it is not empty, and
+ * otherwise keeping only the labels of the current and previous rows
+ */
+template <typename T>
+void MotionRegions::findRegions(const cv::Mat_<T> & motion) {
+	// Label zero means excluded
+	m_parents.push_back(0);
+	std::vector<Region> labelStats(1);
+	std::vector<int> motionRow(motion.cols);
+	std::vector<int> aboveMotionRow(motion.cols);
+	std::vector<int> rowLabels[2];
+	if (m_labels.empty()) {
+		rowLabels[0].resize(motion.cols);
+		rowLabels[1].resize(motion.cols);
+	}
+
+	for (int y = 0; y < motion.rows; y++) {
+		int * labelRow = m_labels.empty() ? rowLabels[y % 2].data() : m_labels[y];
+		const int * aboveLabelRow = y == 0 ? nullptr
+			: m_labels.empty() ? rowLabels[(y - 1) % 2].data() : m_labels[y - 1];
+		std::copy(motion[y], motion[y] + motion.cols, motionRow.begin());
+		for (int x = 0; x < motion.cols; x++) {
+			int value = motionRow[x];
+			if (value == 0 || value == MotionValue<T>::NOT_FOUND) {
+				labelRow[x] = 0;
+				continue;
+			}
+			int left = x > 0 && motionRow[x - 1] == value ? labelRow[x - 1] : 0;
+			int above = y > 0 && aboveMotionRow[x] == value ? aboveLabelRow[x] : 0;
+			int label;
+			if (left && above) {
+				label = left;
+				if (left != above) {
+					merge(left, above);
+				}
+			} else if (left || above) {
+				label = left ? left : above;
+			} else {
+				label = m_parents.size();
+				m_parents.push_back(label);
+				Region region = {value, 0, 0, 0, cv::Rect(x, y, 1, 1)};
+				labelStats.push_back(region);
+			}
+			labelRow[x] = label;
+
+			Region & stats = labelStats[label];
+			stats.area++;
+			stats.sumX += x;
+			stats.sumY += y;
+			// The first pixel set the top, and rows are scanned in order
+			cv::Rect & bounds = stats.bounds;
+			if (x < bounds.x) {
+				bounds.width += bounds.x - x;
+				bounds.x = x;
+			} else if (x >= bounds.x + bounds.width) {
+				bounds.width = x - bounds.x + 1;
+			}
+			bounds.height = y - bounds.y + 1;
+		}
+		motionRow.swap(aboveMotionRow);
+	}
+
+	// Combine the labels into regions. A label's root is never higher than
+	// the label itself, so it has already been given a region.
+	std::vector<int> roots(m_parents.size());
+	for (size_t label = 1; label < m_parents.size(); label++) {
+		roots[label] = findRoot(label);
+	}
+	for (size_t label = 1; label < m_parents.size(); label++) {
+		int root = roots[label];
+		const Region & stats = labelStats[label];
+		if (root == (int)label) {
+			m_parents[label] = m_regions.size();
+			m_regions.push_back(stats);
+		} else {
+			int index = m_parents[root];
+			m_parents[label] = index;
+			Region & region = m_regions[index];
+			region.area += stats.area;
+			region.sumX += stats.sumX;
+			region.sumY += stats.sumY;
+			region.bounds |= stats.bounds;
+		}
+	}
+}
+
+template MotionRegions::MotionRegions(cv::Mat_<int16_t> motion, cv::Mat * labelBuffer);
+template MotionRegions::MotionRegions(cv::Mat_<int> motion, cv::Mat * labelBuffer);
+template MotionRegions MotionRegions::FindWithoutLabels(const cv::Mat_<int16_t> & motion);
+template MotionRegions MotionRegions::FindWithoutLabels(const cv::Mat_<int> & motion);
+
+/**
+ * Label the rows again. Each pixel takes the same provisional label as when
+ * the regions were found, since the labels are chosen in the same way and
+ * numbered in the same order, and merging does not change them.
+ */
+template <typename T>
+MotionRegions::RowScanner<T>::RowScanner(const MotionRegions & regions,
+		const cv::Mat_<T> & motion)
+	: m_regions(regions), m_motion(motion), m_y(0), m_nextLabel(1),
+	m_labels(motion.cols), m_aboveLabels(motion.cols)
+{}
+
+template <typename T>
+void MotionRegions::RowScanner<T>::next(int * regionRow) {
+	const T * motionRow = m_motion[m_y];
+	const T * aboveMotionRow = m_y > 0 ? m_motion[m_y - 1] : nullptr;
+	m_labels.swap(m_aboveLabels);
+	for (int x = 0; x < m_motion.cols; x++) {
+		int value = motionRow[x];
+		if (value == 0 || value == MotionValue<T>::NOT_FOUND) {
+			m_labels[x] = 0;
+			regionRow[x] = -1;
+			continue;
+		}
+		int label;
+		if (x > 0 && motionRow[x - 1] == value) {
+			label = m_labels[x - 1];
+		} else if (aboveMotionRow && aboveMotionRow[x] == value) {
+			label = m_aboveLabels[x];
+		} else {
+			label = m_nextLabel++;
+		}
+		m_labels[x] = label;
+		regionRow[x] = m_regions.m_parents[label];
+	}
+	m_y++;
+}
+
+template class MotionRegions::RowScanner<int16_t>;
+template class MotionRegions::RowScanner<int>;
+
+MotionRegions::Mat1b MotionRegions::getMask(int index, int border) const {
+	const cv::Rect & bounds = m_regions[index].bounds;
+	Mat1b mask(bounds.height + border * 2, bounds.width + border * 2, (unsigned char)0);
+	for (int y = 0; y < bounds.height; y++) {
+		const int * labelRow = m_labels[bounds.y + y] + bounds.x;
+		unsigned char * maskRow = mask[y + border] + border;
+		for (int x = 0; x < bounds.width; x++) {
+			if (labelRow[x] && m_parents[labelRow[x]] == index) {
+				maskRow[x] = 255;
+			}
+		}
+	}
+	return mask;
+}
+
+/**
+ * Find the root of a label's tree, compressing the path to it. This is only
+ * valid during labelling.
+ */
+int MotionRegions::findRoot(int label) {
+	int root = label;
+	while (m_parents[root] != root) {
+		root = m_parents[root];
+	}
+	while (m_parents[label] != root) {
+		int next = m_parents[label];
+		m_parents[label] = root;
+		label = next;
+	}
+	return root;
+}
+
+/**
+ * Merge the trees of two labels, keeping the lower root
+ */
+void MotionRegions::merge(int label1, int label2) {
+	int root1 = findRoot(label1);
+	int root2 = findRoot(label2);
+	m_parents[std::max(root1, root2)] = std::min(root1, root2);
+}
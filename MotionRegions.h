@@ -0,0 +1,113 @@
+#include <opencv2/core/core.hpp>
+#include <cstdint>
+#include <vector>
+
+/**
+ * The 4-connected regions of equal motion in a motion field, excluding pixels
+ * with zero motion or with NOT_FOUND. The regions are labelled in a single
+ * pass, which also collects the area, centroid and bounding box of each
+ * region.
+ *
+ * To save memory on tall images, the labels are written over a motion field
+ * of int, so the caller's motion field is not valid afterwards. A motion
+ * field of int16_t is too small for the labels, so it is left unchanged, and
+ * the labels are stored in labelBuffer if it is given, so that the caller can
+ * reuse it.
+ */
+class MotionRegions {
+public:
+	typedef cv::Mat_<int> Mat1i;
+	typedef cv::Mat_<unsigned char> Mat1b;
+
+	struct Region {
+		int motion;
+		int area;
+		int64_t sumX;
+		int64_t sumY;
+		cv::Rect bounds;
+	};
+
+	template <typename T>
+	MotionRegions(cv::Mat_<T> motion, cv::Mat * labelBuffer = nullptr);
+
+	/**
+	 * Find the regions without keeping the labels, so that the memory used
+	 * does not depend on the height of the motion field, which is left
+	 * unchanged. getMask() cannot be used, but the region of each pixel can
+	 * be found one row at a time with a RowScanner.
+	 */
+	template <typename T>
+	static MotionRegions FindWithoutLabels(const cv::Mat_<T> & motion);
+
+	/**
+	 * Gives the region of each pixel of a motion field one row at a time,
+	 * from the top
+	 */
+	template <typename T>
+	class RowScanner {
+	public:
+		RowScanner(const MotionRegions & regions, const cv::Mat_<T> & motion);
+
+		/**
+		 * Write the index of the region of each pixel in the next row, or -1
+		 * for pixels which are not in a region
+		 */
+		void next(int * regionRow);
+
+	private:
+		const MotionRegions & m_regions;
+		cv::Mat_<T> m_motion;
+		int m_y;
+		int m_nextLabel;
+
+		// The provisional labels of the current and previous rows
+		std::vector<int> m_labels;
+		std::vector<int> m_aboveLabels;
+	};
+
+	/**
+	 * Get the regions, in the raster order of their first pixel
+	 */
+	const std::vector<Region> & regions() const {
+		return m_regions;
+	}
+
+	/**
+	 * Get a mask of the pixels in a region, covering its bounding box plus a
+	 * border of the given width. Pixels in the region are 255.
+	 */
+	Mat1b getMask(int index, int border = 0) const;
+
+private:
+	MotionRegions() {}
+
+	template <typename T>
+	void findRegions(const cv::Mat_<T> & motion);
+
+	static Mat1i GetLabelStorage(Mat1i motion, cv::Mat *) {
+		return motion;
+	}
+
+	template <typename T>
+	static Mat1i GetLabelStorage(const cv::Mat_<T> & motion, cv::Mat * labelBuffer) {
+		if (!labelBuffer) {
+			return Mat1i(motion.size());
+		}
+		labelBuffer->create(motion.size(), CV_32S);
+		return *labelBuffer;
+	}
+
+	int findRoot(int label);
+	void merge(int label1, int label2);
+
+	// The provisional label of each pixel, or zero if it is excluded. This
+	// shares the caller's motion field if it is of int. It is empty if the
+	// labels are not kept.
+	Mat1i m_labels;
+
+	// For each provisional label, during labelling, the parent in the
+	// union-find forest. Afterwards, the index of the label's region.
+	std::vector<int> m_parents;
+
+	std::vector<Region> m_regions;
+};
@@ -0,0 +1,28 @@
+#include <cstdint>
+#include <limits>
+
+/**
+ * The sentinel values of a motion field with elements of type T. The motion
+ * field is stored as int16_t when every motion in the image fits, which
+ * halves its size, and as int otherwise.
+ */
+template <typename T>
+struct MotionValue {
+	// No motion was found for the pixel
+	static constexpr T NOT_FOUND = std::numeric_limits<T>::max();
+
+	// The consensus of a brush with differing values
+	static constexpr T INVALID = NOT_FOUND - 1;
+
+	/**
+	 * Determine whether every vertical motion within an image of the given
+	 * height can be stored in T
+	 */
+	static bool Fits(int height) {
+		return height - 1 < (int)INVALID
+			&& 1 - height >= (int)std::numeric_limits<T>::min();
+	}
+};
+
+template <typename T> constexpr T MotionValue<T>::NOT_FOUND;
+template <typename T> constexpr T MotionValue<T>::INVALID;
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <thread>
+
+#include "ResidualHighlighter.h"
+#include "ThreadCpuTime.h"
+
+ResidualHighlighter::ResidualHighlighter(Mat1b & mask, int innerWindow,
+		int outerWindow, int threads, cv::Mat * tableBuffer, cv::Mat * flagsBuffer)
+	: m_mask(mask), m_innerHalf((innerWindow - 1) / 2),
+	m_outerHalf((outerWindow - 1) / 2), m_threads(threads),
+	m_tableBuffer(tableBuffer), m_flagsBuffer(flagsBuffer), m_bufferBytes(0),
+	m_workerCpuTime(0)
+{}
+
+std::vector<cv::Point> ResidualHighlighter::find() {
+	int width = m_mask.cols;
+	int height = m_mask.rows;
+
+	if (m_tableBuffer) {
+		m_tableBuffer->create(height + 1, width + 1, CV_32S);
+		m_table = *m_tableBuffer;
+	} else {
+		m_table = Mat1i(height + 1, width + 1);
+	}
+	std::fill(m_table[0], m_table[0] + width + 1, 0);
+	for (int y = 0; y < height; y++) {
+		const unsigned char * maskRow = m_mask[y];
+		const int * aboveRow = m_table[y];
+		int * tableRow = m_table[y + 1];
+		tableRow[0] = 0;
+		int rowSum = 0;
+		for (int x = 0; x < width; x++) {
+			rowSum += maskRow[x];
+			tableRow[x + 1] = aboveRow[x + 1] + rowSum;
+		}
+	}
+
+	// Find the candidates in parallel, in bands of columns. The table is
+	// not modified, so the bands are independent.
+	if (m_flagsBuffer) {
+		m_flagsBuffer->create(width, height, CV_8U);
+		m_flags = *m_flagsBuffer;
+		m_flags = (unsigned char)0;
+	} else {
+		m_flags = Mat1b(width, height, (unsigned char)0);
+	}
+	m_bufferBytes = m_table.total() * m_table.elemSize() + m_flags.total() * m_flags.elemSize();
+	int threads = std::max(1, std::min(m_threads, width));
+	std::vector<double> cpuTimes(threads, 0);
+	std::vector<std::thread> workers;
+	for (int i = 1; i < threads; i++) {
+		workers.emplace_back([this, i, threads, width, &cpuTimes] {
+			double start = GetThreadCpuTime();
+			findCandidates(width * i / threads, width * (i + 1) / threads);
+			cpuTimes[i] = GetThreadCpuTime() - start;
+		});
+	}
+	findCandidates(0, width / threads);
+	for (auto & worker : workers) {
+		worker.join();
+	}
+	for (double cpuTime : cpuTimes) {
+		m_workerCpuTime += cpuTime;
+	}
+
+	// Confirm the candidates in order, since each erasure affects the later
+	// positions near it
+	std::vector<cv::Point> hits;
+	for (int x = 0; x < width; x++) {
+		const unsigned char * flags = m_flags[x];
+		for (int y = 0; y < height; y++) {
+			if (!flags[y]) {
+				continue;
+			}
+			cv::Point pos(x, y);
+			if (isHit(pos, flags[y])) {
+				hits.push_back(pos);
+				m_mask(getWindow(pos, m_innerHalf)) = 0;
+				markRecheck(pos);
+			}
+		}
+	}
+	m_table.release();
+	m_flags.release();
+	return hits;
+}
+
+/**
+ * Flag the positions in a range of columns for which the counts in the
+ * original mask show a hit
+ */
+void ResidualHighlighter::findCandidates(int firstColumn, int endColumn) {
+	int height = m_mask.rows;
+	for (int x = firstColumn; x < endColumn; x++) {
+		// Skip columns with no residual pixels within the outer window
+		cv::Rect strip = getWindow(cv::Point(x, 0), m_outerHalf);
+		strip.y = 0;
+		strip.height = height;
+		if (!getRawCount(strip)) {
+			continue;
+		}
+
+		unsigned char * flags = m_flags[x];
+		for (int y = 0; y < height; y++) {
+			cv::Point pos(x, y);
+			int innerCount = getRawCount(getWindow(pos, m_innerHalf));
+			if (innerCount != 0
+				&& innerCount == getRawCount(getWindow(pos, m_outerHalf)))
+			{
+				flags[y] = CANDIDATE;
+			}
+		}
+	}
+}
+
+/**
+ * Flag the later positions whose outer window overlaps the erasure at a hit.
+ * Erasing can only reduce the counts, so positions with an inner count of
+ * zero in the original mask cannot become hits.
+ */
+void ResidualHighlighter::markRecheck(const cv::Point & hit) {
+	// The erasure may change the inner counts up to twice the inner half width
+	// away, which is further than the outer window reaches if the inner
+	// window is the larger
+	int reach = m_innerHalf + std::max(m_innerHalf, m_outerHalf);
+	int endX = std::min(hit.x + reach + 1, m_mask.cols);
+	int top = std::max(hit.y - reach, 0);
+	int bottom = std::min(hit.y + reach + 1, m_mask.rows);
+	for (int x = hit.x; x < endX; x++) {
+		unsigned char * flags = m_flags[x];
+		for (int y = (x == hit.x ? hit.y + 1 : top); y < bottom; y++) {
+			if (getRawCount(getWindow(cv::Point(x, y), m_innerHalf))) {
+				flags[y] = RECHECK;
+			}
+		}
+	}
+}
+
+bool ResidualHighlighter::isHit(const cv::Point & pos, unsigned char flag) {
+	if (flag == CANDIDATE) {
+		return true;
+	}
+	int innerCount = getMaskCount(getWindow(pos, m_innerHalf));
+	return innerCount != 0
+		&& innerCount == getMaskCount(getWindow(pos, m_outerHalf));
+}
+
+/**
+ * Get a window centred on the given position, clipped to the mask
+ */
+cv::Rect ResidualHighlighter::getWindow(const cv::Point & pos, int halfWindow) {
+	return cv::Rect(
+		cv::Point(
+			std::max(pos.x - halfWindow, 0),
+			std::max(pos.y - halfWindow, 0)
+		),
+		cv::Point(
+			std::min(pos.x + halfWindow + 1, m_mask.cols),
+			std::min(pos.y + halfWindow + 1, m_mask.rows)
+		)
+	);
+}
+
+/**
+ * Get the sum of the original mask within a rectangle
+ */
+int ResidualHighlighter::getRawCount(const cv::Rect & rect) {
+	int bottom = rect.y + rect.height;
+	int right = rect.x + rect.width;
+	return m_table(bottom, right) - m_table(rect.y, right)
+		- m_table(bottom, rect.x) + m_table(rect.y, rect.x);
+}
+
+/**
+ * Get the sum of the mask within a rectangle, including any erasures
+ */
+int ResidualHighlighter::getMaskCount(const cv::Rect & rect) {
+	int count = 0;
+	for (int y = rect.y; y < rect.y + rect.height; y++) {
+		const unsigned char * maskRow = m_mask[y];
+		for (int x = rect.x; x < rect.x + rect.width; x++) {
+			count += maskRow[x];
+		}
+	}
+	return count;
+}
@@ -0,0 +1,79 @@
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+/**
+ * Find isolated residual pixels: positions where the residual pixels within
+ * an outer window are all within a smaller inner window. Positions are
+ * visited in column-major order, and when one is found, its inner window is
+ * erased from the mask, so that the same group is not found again.
+ *
+ * The window counts come from a summed-area table of the mask, so they are
+ * found in constant time. Since the erasures are rare, they are not applied
+ * to the table. Instead, the positions they could affect are rechecked
+ * against the mask.
+ */
+class ResidualHighlighter {
+public:
+	typedef cv::Mat_<unsigned char> Mat1b;
+	typedef cv::Mat_<int> Mat1i;
+
+	/**
+	 * If tableBuffer and flagsBuffer are given, they are used for the
+	 * working memory, and kept afterwards so that the caller can reuse them.
+	 */
+	ResidualHighlighter(Mat1b & mask, int innerWindow, int outerWindow,
+			int threads = 1, cv::Mat * tableBuffer = nullptr,
+			cv::Mat * flagsBuffer = nullptr);
+
+	/**
+	 * Find the isolated residuals, erasing them from the mask
+	 */
+	std::vector<cv::Point> find();
+
+	/**
+	 * Get the size of the working buffers used by find(), which are freed
+	 * when it returns unless they were given to the constructor
+	 */
+	size_t getBufferBytes() const {
+		return m_bufferBytes;
+	}
+
+	/**
+	 * Get the CPU time in milliseconds used by find() in threads other than
+	 * the calling thread
+	 */
+	double getWorkerCpuTime() const {
+		return m_workerCpuTime;
+	}
+
+private:
+	enum {
+		// The raw counts show a hit, and no erasure has affected them
+		CANDIDATE = 1,
+		// An erasure may have changed the counts, so count the mask again
+		RECHECK = 2
+	};
+
+	void findCandidates(int firstColumn, int endColumn);
+	void markRecheck(const cv::Point & hit);
+	bool isHit(const cv::Point & pos, unsigned char flag);
+	cv::Rect getWindow(const cv::Point & pos, int halfWindow);
+	int getRawCount(const cv::Rect & rect);
+	int getMaskCount(const cv::Rect & rect);
+
+	Mat1b & m_mask;
+	int m_innerHalf;
+	int m_outerHalf;
+	int m_threads;
+	cv::Mat * m_tableBuffer;
+	cv::Mat * m_flagsBuffer;
+	size_t m_bufferBytes;
+	double m_workerCpuTime;
+
+	// The summed-area table of the original mask, with an extra leading row
+	// and column of zeroes
+	Mat1i m_table;
+
+	// The candidate flags, transposed so that each column is contiguous
+	Mat1b m_flags;
+};
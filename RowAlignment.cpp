@@ -0,0 +1,134 @@
+#include <cstring>
+
+#include "RowAlignment.h"
+#include "BlockHashIndex.h"
+
+std::vector<int> RowAlignment::Align(const Mat3b & source, const Mat3b & dest,
+		int maxEdits)
+{
+	RowAlignment obj(source, dest);
+	int sourceEnd = source.rows;
+	int destEnd = dest.rows;
+
+	// Common prefix
+	int start = 0;
+	while (start < sourceEnd && start < destEnd && obj.rowEqual(start, start)) {
+		obj.match(start, start);
+		start++;
+	}
+
+	// Common suffix
+	while (sourceEnd > start && destEnd > start
+		&& obj.rowEqual(sourceEnd - 1, destEnd - 1))
+	{
+		obj.match(sourceEnd - 1, destEnd - 1);
+		sourceEnd--;
+		destEnd--;
+	}
+
+	obj.diff(start, sourceEnd, destEnd, maxEdits);
+	return obj.m_motion;
+}
+
+RowAlignment::RowAlignment(const Mat3b & source, const Mat3b & dest)
+	: m_source(source), m_dest(dest),
+	m_sourceHashes(HashRows(source)), m_destHashes(HashRows(dest)),
+	m_motion(source.rows, NOT_FOUND)
+{}
+
+std::vector<uint64_t> RowAlignment::HashRows(const Mat3b & image) {
+	std::vector<uint64_t> hashes(image.rows);
+	for (int y = 0; y < image.rows; y++) {
+		hashes[y] = BlockHashIndex::HashRow(image[y], image.cols);
+	}
+	return hashes;
+}
+
+/**
+ * Find the longest common subsequence of the rows in the middle section with
+ * Myers' O(ND) algorithm, and record the rows in it. Return false if there
+ * were too many edits.
+ */
+bool RowAlignment::diff(int start, int sourceEnd, int destEnd, int maxEdits) {
+	const uint64_t * a = m_sourceHashes.data() + start;
+	const uint64_t * b = m_destHashes.data() + start;
+	int n = sourceEnd - start;
+	int m = destEnd - start;
+	int maxD = std::min(n + m, maxEdits);
+
+	// v[offset + k] is the furthest x reached on diagonal k = x - y. The state
+	// after each edit count d is saved for the diagonals -d..d, so that the
+	// path can be recovered.
+	int offset = maxD + 1;
+	std::vector<int> v(2 * maxD + 3, 0);
+	std::vector<std::vector<int>> trace;
+	int d;
+	bool found = false;
+	for (d = 0; d <= maxD && !found; d++) {
+		for (int k = -d; k <= d; k += 2) {
+			int x;
+			if (k == -d || (k != d && v[offset + k - 1] < v[offset + k + 1])) {
+				x = v[offset + k + 1];
+			} else {
+				x = v[offset + k - 1] + 1;
+			}
+			int y = x - k;
+			while (x < n && y < m && a[x] == b[y]) {
+				x++;
+				y++;
+			}
+			v[offset + k] = x;
+			if (x >= n && y >= m) {
+				found = true;
+				break;
+			}
+		}
+		trace.emplace_back(v.begin() + offset - d, v.begin() + offset + d + 1);
+	}
+	if (!found) {
+		return false;
+	}
+
+	// Walk back through the saved states, recording the diagonal runs
+	int x = n, y = m;
+	for (d = (int)trace.size() - 1; d >= 0; d--) {
+		int prevX, prevY;
+		if (d == 0) {
+			prevX = prevY = 0;
+		} else {
+			const std::vector<int> & prev = trace[d - 1];
+			int prevOffset = d - 1;
+			int k = x - y;
+			int prevK;
+			if (k == -d || (k != d && prev[prevOffset + k - 1] < prev[prevOffset + k + 1])) {
+				prevK = k + 1;
+			} else {
+				prevK = k - 1;
+			}
+			prevX = prev[prevOffset + prevK];
+			prevY = prevX - prevK;
+		}
+		while (x > prevX && y > prevY) {
+			x--;
+			y--;
+			if (rowEqual(start + x, start + y)) {
+				match(start + x, start + y);
+			}
+		}
+		x = prevX;
+		y = prevY;
+	}
+	return true;
+}
+
+void RowAlignment::match(int sourceY, int destY) {
+	m_motion[sourceY] = destY - sourceY;
+}
+
+/**
+ * Compare two rows, first by hash and then by content
+ */
+bool RowAlignment::rowEqual(int sourceY, int destY) {
+	return m_sourceHashes[sourceY] == m_destHashes[destY]
+		&& std::memcmp(m_source[sourceY], m_dest[destY], m_source.cols * 3) == 0;
+}
@@ -0,0 +1,40 @@
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+/**
+ * Alignment of the rows of two images of the same width, by a diff of the
+ * sequences of row hashes. Most differences between browser screenshots are
+ * insertions or removals of content, which move whole bands of full-width
+ * rows. Such motion can be found in one linear pass over the rows, without
+ * searching for each block.
+ */
+class RowAlignment {
+public:
+	typedef cv::Mat_<cv::Vec3b> Mat3b;
+
+	enum {NOT_FOUND = 0x7fffffff};
+
+	/**
+	 * Get the vertical offset from each row of the source image to an
+	 * identical row of the destination image, or NOT_FOUND if the row was
+	 * not part of the alignment. If the alignment needs more than maxEdits
+	 * row insertions and deletions, only the common prefix and suffix of the
+	 * images are aligned.
+	 */
+	static std::vector<int> Align(const Mat3b & source, const Mat3b & dest,
+			int maxEdits = 2000);
+
+private:
+	RowAlignment(const Mat3b & source, const Mat3b & dest);
+
+	static std::vector<uint64_t> HashRows(const Mat3b & image);
+	bool diff(int start, int sourceEnd, int destEnd, int maxEdits);
+	void match(int sourceY, int destY);
+	bool rowEqual(int sourceY, int destY);
+
+	const Mat3b & m_source;
+	const Mat3b & m_dest;
+	std::vector<uint64_t> m_sourceHashes;
+	std::vector<uint64_t> m_destHashes;
+	std::vector<int> m_motion;
+};
@@ -0,0 +1,80 @@
+#ifndef SEARCHCOUNTERS_H
+#define SEARCHCOUNTERS_H
+
+/**
+ * Counts of the work done by the block motion search, for finding out why
+ * some inputs are slow and for tuning the block and window sizes
+ */
+struct SearchCounters {
+	enum {
+		// The number of buckets in the histogram of search distances
+		DISTANCE_BUCKETS = 20
+	};
+
+	// The priorities of the ways a block's motion can be found, in the order
+	// they are tried
+	enum Priority {
+		CONSTANT_BASELINE,
+		VERTICAL_FLOW,
+		NEAR_BASELINE,
+		SOURCE_OFFSET,
+		PRIORITY_COUNT
+	};
+
+	// Blocks in clean tiles, which have zero motion without searching
+	int cleanBlocks = 0;
+
+	// Blocks whose motion was found by row alignment
+	int alignedBlocks = 0;
+
+	// Blocks which were searched, and those of them with no match
+	int searchedBlocks = 0;
+	int notFoundBlocks = 0;
+
+	// Searched blocks for which only the predicted motion was tried, since
+	// the probe budget was exceeded
+	int degradedBlocks = 0;
+
+	// Calls to tryMotion(), each of which compares a pair of blocks
+	long long probes = 0;
+
+	// The positions with a matching hash which were visited by the outward
+	// search of the index
+	long long candidates = 0;
+
+	// The blocks found by each priority
+	int priorityHits[PRIORITY_COUNT] = {};
+
+	// For blocks found by the outward search, the distance from the start of
+	// the search. Bucket 0 counts a distance of zero, and bucket i counts the
+	// distances from 2^(i-1) to 2^i - 1. The last bucket also counts any
+	// larger distance.
+	int distanceHistogram[DISTANCE_BUCKETS] = {};
+
+	void addDistance(int distance) {
+		int bucket = 0;
+		while (distance > 0 && bucket < DISTANCE_BUCKETS - 1) {
+			distance >>= 1;
+			bucket++;
+		}
+		distanceHistogram[bucket]++;
+	}
+
+	void add(const SearchCounters & other) {
+		cleanBlocks += other.cleanBlocks;
+		alignedBlocks += other.alignedBlocks;
+		searchedBlocks += other.searchedBlocks;
+		notFoundBlocks += other.notFoundBlocks;
+		degradedBlocks += other.degradedBlocks;
+		probes += other.probes;
+		candidates += other.candidates;
+		for (int i = 0; i < PRIORITY_COUNT; i++) {
+			priorityHits[i] += other.priorityHits[i];
+		}
+		for (int i = 0; i < DISTANCE_BUCKETS; i++) {
+			distanceHistogram[i] += other.distanceHistogram[i];
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include <algorithm>
+#include <cstring>
+
+#include "StreamingHighlighter.h"
+
+StreamingHighlighter::StreamingHighlighter(const cv::Size & size, int innerWindow,
+		int outerWindow, cv::Mat * maskBuffer, cv::Mat * flagsBuffer)
+	: m_width(size.width), m_height(size.height),
+	m_innerHalf((innerWindow - 1) / 2), m_outerHalf((outerWindow - 1) / 2),
+	m_windowHalf(std::max(m_innerHalf, m_outerHalf)),
+	m_reach(m_innerHalf + m_windowHalf), m_lead(m_reach + 1),
+	m_rows(0), m_candidateRows(0),
+	m_innerColumns(m_width, 0), m_outerColumns(m_width, 0),
+	m_innerSums(m_width + 1, 0), m_outerSums(m_width + 1, 0),
+	m_front(m_width, 0)
+{
+	// The ring holds the rows from the oldest one which the last column may
+	// still read, up to the newest row added
+	int ringRows = std::min(m_height,
+			(m_width - 1) * m_reach + m_lead + m_windowHalf * 2 + 1);
+	if (maskBuffer) {
+		maskBuffer->create(ringRows, m_width, CV_8U);
+		m_mask = *maskBuffer;
+	} else {
+		m_mask = Mat1b(ringRows, m_width);
+	}
+	if (flagsBuffer) {
+		flagsBuffer->create(ringRows, m_width, CV_8U);
+		m_flags = *flagsBuffer;
+	} else {
+		m_flags = Mat1b(ringRows, m_width);
+	}
+}
+
+unsigned char * StreamingHighlighter::getNextRow() {
+	unsigned char * row = maskRow(m_rows);
+	std::fill(row, row + m_width, 0);
+	return row;
+}
+
+void StreamingHighlighter::addRow() {
+	m_rows++;
+	// Find the candidates in each row once every row within the larger
+	// window below it has been added
+	int end = m_rows == m_height ? m_height : m_rows - m_windowHalf;
+	for (; m_candidateRows < end; m_candidateRows++) {
+		findCandidates(m_candidateRows);
+	}
+	advance();
+}
+
+int StreamingHighlighter::getCompleteRows() const {
+	// The last column is the furthest behind
+	return m_front[m_width - 1];
+}
+
+void StreamingHighlighter::takeHits(std::vector<cv::Point> & hits) {
+	hits.insert(hits.end(), m_hits.begin(), m_hits.end());
+	m_hits.clear();
+}
+
+/**
+ * Flag the positions in a row for which the raw counts show a hit, or which
+ * have a nonzero raw inner count. The column counts are slid down by one row,
+ * which needs the row leaving the windows to be unchanged by any erasure,
+ * and this is ensured by the lead.
+ */
+void StreamingHighlighter::findCandidates(int y) {
+	auto addRowTo = [this](std::vector<int> & columns, int row, int sign) {
+		if (row < 0 || row >= m_height) {
+			return;
+		}
+		const unsigned char * mask = maskRow(row);
+		for (int x = 0; x < m_width; x++) {
+			columns[x] += sign * mask[x];
+		}
+	};
+	if (y == 0) {
+		for (int row = 0; row <= m_innerHalf; row++) {
+			addRowTo(m_innerColumns, row, 1);
+		}
+		for (int row = 0; row <= m_outerHalf; row++) {
+			addRowTo(m_outerColumns, row, 1);
+		}
+	} else {
+		addRowTo(m_innerColumns, y + m_innerHalf, 1);
+		addRowTo(m_innerColumns, y - m_innerHalf - 1, -1);
+		addRowTo(m_outerColumns, y + m_outerHalf, 1);
+		addRowTo(m_outerColumns, y - m_outerHalf - 1, -1);
+	}
+
+	for (int x = 0; x < m_width; x++) {
+		m_innerSums[x + 1] = m_innerSums[x] + m_innerColumns[x];
+		m_outerSums[x + 1] = m_outerSums[x] + m_outerColumns[x];
+	}
+	unsigned char * flags = flagsRow(y);
+	for (int x = 0; x < m_width; x++) {
+		int innerCount = m_innerSums[std::min(x + m_innerHalf + 1, m_width)]
+			- m_innerSums[std::max(x - m_innerHalf, 0)];
+		int outerCount = m_outerSums[std::min(x + m_outerHalf + 1, m_width)]
+			- m_outerSums[std::max(x - m_outerHalf, 0)];
+		flags[x] = innerCount == 0 ? 0
+			: innerCount == outerCount ? INNER | CANDIDATE : INNER;
+	}
+}
+
+/**
+ * Move each column's front down as far as it can go. The first column stays
+ * behind the candidates by the lead, and each other column stays behind the
+ * column to its left by the reach, so that no hit in a later column can
+ * affect the positions which are still to be confirmed. Once every row has
+ * its candidates, the columns are finished in order.
+ */
+void StreamingHighlighter::advance() {
+	bool finished = m_candidateRows == m_height;
+	int limit = finished ? m_height : std::max(m_candidateRows - m_lead, 0);
+	for (int x = 0; x < m_width; x++) {
+		int end = limit;
+		if (x > 0 && !finished) {
+			end = std::min(end, m_front[x - 1] - m_reach);
+		}
+		if (end <= m_front[x] && !finished) {
+			// The columns to the right are waiting for this one
+			break;
+		}
+		for (int y = m_front[x]; y < end; y++) {
+			confirm(x, y);
+			m_front[x] = y + 1;
+		}
+	}
+}
+
+/**
+ * Confirm whether a position is a hit, and if so, erase its inner window and
+ * flag the positions it could affect for rechecking
+ */
+void StreamingHighlighter::confirm(int x, int y) {
+	unsigned char flags = flagsRow(y)[x];
+	if (!(flags & (CANDIDATE | RECHECK))) {
+		return;
+	}
+	cv::Point pos(x, y);
+	if (flags & RECHECK) {
+		int innerCount = getMaskCount(pos, m_innerHalf);
+		if (innerCount == 0 || innerCount != getMaskCount(pos, m_outerHalf)) {
+			return;
+		}
+	}
+	m_hits.push_back(pos);
+	int left = std::max(x - m_innerHalf, 0);
+	int right = std::min(x + m_innerHalf + 1, m_width);
+	int bottom = std::min(y + m_innerHalf + 1, m_height);
+	for (int row = std::max(y - m_innerHalf, 0); row < bottom; row++) {
+		std::memset(maskRow(row) + left, 0, right - left);
+	}
+	markRecheck(pos);
+}
+
+/**
+ * Flag the later positions which the erasure at a hit could affect. As in
+ * ResidualHighlighter, only positions with a nonzero raw inner count can
+ * become hits. Positions which were already confirmed are skipped, since
+ * their rows may have left the ring.
+ */
+void StreamingHighlighter::markRecheck(const cv::Point & hit) {
+	int endX = std::min(hit.x + m_reach + 1, m_width);
+	int top = std::max(hit.y - m_reach, 0);
+	int bottom = std::min(hit.y + m_reach + 1, m_height);
+	for (int x = hit.x; x < endX; x++) {
+		for (int y = (x == hit.x ? hit.y + 1 : std::max(top, m_front[x])); y < bottom; y++) {
+			unsigned char & flags = flagsRow(y)[x];
+			if (flags & INNER) {
+				flags |= RECHECK;
+			}
+		}
+	}
+}
+
+/**
+ * Get the sum of the mask, including any erasures, within a window centred on
+ * the given position
+ */
+int StreamingHighlighter::getMaskCount(const cv::Point & pos, int halfWindow) {
+	int left = std::max(pos.x - halfWindow, 0);
+	int right = std::min(pos.x + halfWindow + 1, m_width);
+	int bottom = std::min(pos.y + halfWindow + 1, m_height);
+	int count = 0;
+	for (int y = std::max(pos.y - halfWindow, 0); y < bottom; y++) {
+		const unsigned char * mask = maskRow(y);
+		for (int x = left; x < right; x++) {
+			count += mask[x];
+		}
+	}
+	return count;
+}
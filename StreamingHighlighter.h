@@ -0,0 +1,128 @@
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+/**
+ * Find the same isolated residuals as ResidualHighlighter, with the mask given
+ * one row at a time, so that the memory used depends on the width of the mask
+ * but not its height.
+ *
+ * A hit erases its inner window, which can change whether the positions
+ * within reach to the right of it, or below it in the same column, are hits.
+ * So rather than finishing each column before starting the next, the columns
+ * advance together as a wavefront, with each column kept behind the one to
+ * its left by the reach. Each position is then confirmed after every earlier
+ * position that could affect it, and before every later one that it could
+ * affect, which gives the same hits as visiting them in column-major order.
+ * The rows between the front of the first column and the back of the last
+ * are held in a ring.
+ */
+class StreamingHighlighter {
+public:
+	typedef cv::Mat_<unsigned char> Mat1b;
+
+	/**
+	 * If maskBuffer and flagsBuffer are given, they are used for the ring,
+	 * and kept afterwards so that the caller can reuse them.
+	 */
+	StreamingHighlighter(const cv::Size & size, int innerWindow, int outerWindow,
+			cv::Mat * maskBuffer = nullptr, cv::Mat * flagsBuffer = nullptr);
+
+	/**
+	 * Get the next row of the mask for the caller to fill, with every pixel
+	 * zero. The residual pixels are marked with 1.
+	 */
+	unsigned char * getNextRow();
+
+	/**
+	 * Add the row given by getNextRow(), and confirm the hits which no longer
+	 * depend on the rows still to come. After the last row, all remaining
+	 * hits are confirmed.
+	 */
+	void addRow();
+
+	/**
+	 * Get the number of rows, from the top, within which every hit has been
+	 * found
+	 */
+	int getCompleteRows() const;
+
+	/**
+	 * Move the hits found since the previous call to the end of the given
+	 * vector. The hits are not in column-major order.
+	 */
+	void takeHits(std::vector<cv::Point> & hits);
+
+	/**
+	 * Get the size of the ring
+	 */
+	size_t getBufferBytes() const {
+		return m_mask.total() * m_mask.elemSize() + m_flags.total() * m_flags.elemSize();
+	}
+
+private:
+	enum {
+		// The raw counts show a hit
+		CANDIDATE = 1,
+		// An erasure may have changed the counts, so count the mask again
+		RECHECK = 2,
+		// The raw inner count is nonzero, so the position may become a hit
+		INNER = 4
+	};
+
+	void findCandidates(int y);
+	void advance();
+	void confirm(int x, int y);
+	void markRecheck(const cv::Point & hit);
+	int getMaskCount(const cv::Point & pos, int halfWindow);
+
+	unsigned char * maskRow(int y) {
+		return m_mask[y % m_mask.rows];
+	}
+
+	unsigned char * flagsRow(int y) {
+		return m_flags[y % m_flags.rows];
+	}
+
+	int m_width;
+	int m_height;
+	int m_innerHalf;
+	int m_outerHalf;
+
+	// The half width of the larger window
+	int m_windowHalf;
+
+	// The furthest distance in either axis at which an erasure can change
+	// the counts of another position
+	int m_reach;
+
+	// The number of rows by which the candidates must lead the first column,
+	// so that the rows they count are not yet erased, and the raw inner count
+	// of every position which a hit could mark is known
+	int m_lead;
+
+	// The ring of mask rows, including the erasures
+	Mat1b m_mask;
+
+	// The ring of candidate flags
+	Mat1b m_flags;
+
+	// The number of rows added
+	int m_rows;
+
+	// The number of rows for which the candidates have been found
+	int m_candidateRows;
+
+	// The raw counts of the inner and outer windows in each column, centred
+	// on the next row of candidates
+	std::vector<int> m_innerColumns;
+	std::vector<int> m_outerColumns;
+
+	// The cumulative sums of the column counts along the row
+	std::vector<int> m_innerSums;
+	std::vector<int> m_outerSums;
+
+	// The number of rows confirmed in each column
+	std::vector<int> m_front;
+
+	std::vector<cv::Point> m_hits;
+};
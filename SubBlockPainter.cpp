@@ -0,0 +1,140 @@
+#include <algorithm>
+
+#include "SubBlockPainter.h"
+
+/**
+ * Paint rows or columns, in both directions. Each step of the brush needs the
+ * consensus of the motion values under it. Instead of rescanning the brush at
+ * each step, there is a tracker for each position along the line, which is
+ * slid by one pixel when moving to the next line.
+ *
+ * The consensus region is narrower than the brush by one pixel at each end
+ * when painting left or up. This comes from the original normalisation of
+ * the region's corners when the brush vector was negative, and is kept so that
+ * the output does not change.
+ */
+template <typename T>
+void SubBlockPainter<T>::paintLines(bool rows, const SkipFunction & skip) {
+	if (rows) {
+		m_lines = m_motion;
+	} else {
+		if (m_transposeBuffer) {
+			m_transposeBuffer->create(m_motion.cols, m_motion.rows, m_motion.type());
+			m_lines = *m_transposeBuffer;
+		}
+		cv::transpose(m_motion, m_lines);
+	}
+	int lineCount = m_lines.rows;
+	int narrowHalfWidth = std::max(m_halfWidth - 1, 0);
+	LineTrackers full(m_lines, m_halfWidth);
+	LineTrackers narrow(m_lines, narrowHalfWidth);
+
+	for (int line = narrowHalfWidth; line < lineCount - narrowHalfWidth; line++) {
+		if (skip && skip(line)) {
+			continue;
+		}
+		if (line >= m_halfWidth && line < lineCount - m_halfWidth) {
+			// Paint right or down
+			full.moveTo(line);
+			paintLine(rows, line, true, full, narrow);
+		}
+		// Paint left or up
+		narrow.moveTo(line);
+		paintLine(rows, line, false, narrow, full);
+	}
+
+	if (!rows) {
+		cv::transpose(m_lines, m_motion);
+	}
+	m_lines.release();
+}
+
+/**
+ * Paint along a line. A step of the brush is painted with the consensus of
+ * the previous step, if the previous step was unanimous and the current step
+ * is entirely NOT_FOUND. Painting stops at any pixel where the moved image
+ * would not match.
+ *
+ * Painting was intended to also continue over steps where the motion which
+ * was found agrees with the previous step, but the original weak consensus
+ * function returned INVALID on the first value other than NOT_FOUND, and this
+ * is kept for compatibility.
+ */
+template <typename T>
+void SubBlockPainter<T>::paintLine(bool rows, int line, bool forward,
+		LineTrackers & consensus, LineTrackers & other)
+{
+	int length = m_lines.cols;
+	int firstAcross = std::max(line - m_halfWidth, 0);
+	int lastAcross = std::min(line + m_halfWidth, m_lines.rows - 1);
+	int imageHeight = m_bob.rows;
+	T prevConsensus = NOT_FOUND;
+	for (int i = 0; i < length; i++) {
+		int along = forward ? i : length - 1 - i;
+		Tracker & tracker = consensus[along];
+
+		// Paint the current step
+		if (prevConsensus != NOT_FOUND && prevConsensus != INVALID
+			&& tracker.isNotFound())
+		{
+			for (int across = firstAcross; across <= lastAcross; across++) {
+				cv::Point srcPos = rows ? cv::Point(along, across) : cv::Point(across, along);
+				int destY = srcPos.y + prevConsensus;
+				if (destY >= 0 && destY < imageHeight
+					&& m_bob(srcPos) == m_alice(destY, srcPos.x))
+				{
+					T & value = m_lines(across, along);
+					consensus.update(along, across, value, prevConsensus);
+					other.update(along, across, value, prevConsensus);
+					value = prevConsensus;
+				}
+			}
+		}
+
+		prevConsensus = tracker.getStrongConsensus();
+	}
+}
+
+/**
+ * Centre the trackers on the given line, by sliding them if they were on the
+ * previous line, or otherwise by counting from scratch.
+ */
+template <typename T>
+void SubBlockPainter<T>::LineTrackers::moveTo(int line) {
+	if (line == m_line) {
+		return;
+	}
+	int length = m_lines.cols;
+	if (m_line >= 0 && line == m_line + 1) {
+		const T * leaving = m_lines[line - m_halfWidth - 1];
+		const T * entering = m_lines[line + m_halfWidth];
+		for (int along = 0; along < length; along++) {
+			m_trackers[along].replace(leaving[along], entering[along]);
+		}
+	} else {
+		m_trackers.assign(length, Tracker());
+		for (int across = line - m_halfWidth; across <= line + m_halfWidth; across++) {
+			const T * values = m_lines[across];
+			for (int along = 0; along < length; along++) {
+				m_trackers[along].add(values[along]);
+			}
+		}
+	}
+	m_line = line;
+}
+
+/**
+ * Update the tracker for a pixel which is about to be painted, if the pixel
+ * is within the tracked region.
+ */
+template <typename T>
+void SubBlockPainter<T>::LineTrackers::update(int along, int across,
+		T oldValue, T newValue)
+{
+	if (m_line >= 0 && across >= m_line - m_halfWidth && across <= m_line + m_halfWidth) {
+		m_trackers[along].replace(oldValue, newValue);
+	}
+}
+
+template class SubBlockPainter<int16_t>;
+template class SubBlockPainter<int>;
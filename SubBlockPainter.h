@@ -0,0 +1,95 @@
+#include <opencv2/core/core.hpp>
+#include <functional>
+#include <vector>
+#include "ConsensusTracker.h"
+
+/**
+ * Expansion of block motion into the sub-block NOT_FOUND regions, by painting
+ * along each row and column with a brush perpendicular to the direction of
+ * travel.
+ *
+ * T is the element type of the motion field, either int16_t or int.
+ */
+template <typename T>
+class SubBlockPainter {
+public:
+	typedef cv::Mat_<cv::Vec3b> Mat3b;
+	typedef cv::Mat_<T> MotionField;
+	typedef std::function<bool(int)> SkipFunction;
+	typedef ConsensusTracker<T> Tracker;
+
+	static constexpr T NOT_FOUND = MotionValue<T>::NOT_FOUND;
+	static constexpr T INVALID = MotionValue<T>::INVALID;
+
+	/**
+	 * If transposeBuffer is given, it is used for the transposed copy of the
+	 * motion field, and kept afterwards so that the caller can reuse it.
+	 */
+	SubBlockPainter(MotionField & motion, const Mat3b & alice, const Mat3b & bob,
+			int brushWidth, cv::Mat * transposeBuffer = nullptr)
+		: m_motion(motion), m_alice(alice), m_bob(bob),
+		m_halfWidth((brushWidth - 1) / 2), m_transposeBuffer(transposeBuffer)
+	{}
+
+	/**
+	 * Paint each row right and then left. Rows for which skip() returns true
+	 * are not painted.
+	 */
+	void paintRows(const SkipFunction & skip = SkipFunction()) {
+		paintLines(true, skip);
+	}
+
+	/**
+	 * Paint each column down and then up. Columns for which skip() returns
+	 * true are not painted.
+	 */
+	void paintColumns(const SkipFunction & skip = SkipFunction()) {
+		paintLines(false, skip);
+	}
+
+private:
+	/**
+	 * The consensus trackers for every position along a line, each covering
+	 * the motion values within a given half width across the line.
+	 */
+	class LineTrackers {
+	public:
+		LineTrackers(const MotionField & lines, int halfWidth)
+			: m_lines(lines), m_halfWidth(halfWidth), m_line(-1)
+		{}
+
+		void moveTo(int line);
+		void update(int along, int across, T oldValue, T newValue);
+
+		Tracker & operator[](int along) {
+			return m_trackers[along];
+		}
+
+	private:
+		const MotionField & m_lines;
+		int m_halfWidth;
+		int m_line;
+		std::vector<Tracker> m_trackers;
+	};
+
+	void paintLines(bool rows, const SkipFunction & skip);
+	void paintLine(bool rows, int line, bool forward,
+			LineTrackers & consensus, LineTrackers & other);
+
+	MotionField & m_motion;
+	const Mat3b & m_alice;
+	const Mat3b & m_bob;
+	int m_halfWidth;
+	cv::Mat * m_transposeBuffer;
+
+	// The motion field with each line being painted stored as a row. When
+	// painting columns this is a transposed copy, so that the brush and the
+	// trackers read contiguous memory instead of striding down the image.
+	MotionField m_lines;
+};
+
+template <typename T>
+constexpr T SubBlockPainter<T>::NOT_FOUND;
+
+template <typename T>
+constexpr T SubBlockPainter<T>::INVALID;
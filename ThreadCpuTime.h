@@ -0,0 +1,17 @@
+#ifndef THREADCPUTIME_H
+#define THREADCPUTIME_H
+
+#include <time.h>
+
+/**
+ * Get the CPU time used by the calling thread, in milliseconds. Unlike
+ * std::clock(), this does not include the other threads of the process, such
+ * as those of other diffs running at the same time.
+ */
+inline double GetThreadCpuTime() {
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+#endif
@@ -1,13 +1,20 @@
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <stdexcept>
 
 #include "UprightDiff.h"
 #include "BlockMotionSearch.h"
-#include "RollingBlockCounter.h"
+#include "IntermediateWriter.h"
+#include "MotionRegions.h"
+#include "ResidualHighlighter.h"
+#include "StreamingHighlighter.h"
+#include "SubBlockPainter.h"
+#include "ThreadCpuTime.h"
 
 typedef UprightDiff::uchar uchar;
 typedef UprightDiff::Mat3b Mat3b;
@@ -16,369 +23,965 @@ typedef UprightDiff::Mat1b Mat1b;
 
 void UprightDiff::Diff(const cv::Mat & alice, const cv::Mat & bob, const Options & options,
 		Output & output) {
-	UprightDiff uprightDiff(alice, bob, options, output);
+	UprightDiff uprightDiff(alice, bob, options, output, nullptr);
 	uprightDiff.execute();
-	uprightDiff.m_alice.release();
-	uprightDiff.m_bob.release();
-	uprightDiff.m_motion.release();
+	uprightDiff.finish();
+}
+
+void UprightDiff::Diff(const cv::Mat & alice, const cv::Mat & bob, const Options & options,
+		Output & output, Context & context) {
+	UprightDiff uprightDiff(alice, bob, options, output, &context);
+	uprightDiff.execute();
+	uprightDiff.finish();
 }
 
 UprightDiff::UprightDiff(
 		const cv::Mat & alice,
 		const cv::Mat & bob,
 		const Options & options,
-		Output & output)
-	: m_options(options), m_output(output), 
+		Output & output,
+		Context * context)
+	: m_options(options), m_output(output), m_context(context),
 	m_logger(options.logStream ? *options.logStream : std::cerr,
-			options.logLevel, options.logTimestamp)
+			options.logLevel, options.logTimestamp),
+	m_stageStart(std::chrono::steady_clock::now()),
+	m_stageCpuStart(GetThreadCpuTime()),
+	m_workerCpuTime(0),
+	m_bufferBytes(0),
+	m_inputCopyBytes(0)
 {
+	m_output.timings.clear();
+	m_output.peakBufferBytes = 0;
+	m_output.search = SearchCounters();
+	if (drawsInStrips() && !options.intermediateDir.empty()) {
+		throw std::runtime_error("Intermediate images cannot be written when "
+				"the visual output is drawn in strips");
+	}
+	if (!options.intermediateDir.empty()) {
+		m_intermediateWriter.reset(new IntermediateWriter(options.intermediateDir));
+	}
+
 	m_size = cv::Size(
 			std::max(alice.cols, bob.cols),
 			std::max(alice.rows, bob.rows));
 	info() << "Extending both images to size " << m_size.width << "x" << m_size.height << "\n";
 
-	m_alice = ConvertInput("first", alice, m_size);
-	m_bob = ConvertInput("second", bob, m_size);
+	m_alice = convertInput("first", alice, &Context::alice);
+	m_bob = convertInput("second", bob, &Context::bob);
+}
+
+/**
+ * Record the time taken by a stage, which is the time since the previous
+ * stage ended
+ */
+void UprightDiff::endStage(const char * stage) {
+	auto now = std::chrono::steady_clock::now();
+	double cpuNow = GetThreadCpuTime();
+	std::chrono::duration<double, std::milli> elapsed = now - m_stageStart;
+	double cpuElapsed = cpuNow - m_stageCpuStart + m_workerCpuTime;
+	m_output.timings.push_back(Output::StageTiming{stage, elapsed.count(), cpuElapsed});
+	m_stageStart = now;
+	m_stageCpuStart = cpuNow;
+	m_workerCpuTime = 0;
+}
+
+/**
+ * Account for an allocated buffer
+ */
+void UprightDiff::addBufferBytes(size_t bytes) {
+	m_bufferBytes += bytes;
+	m_output.peakBufferBytes = std::max(m_output.peakBufferBytes, m_bufferBytes);
+}
+
+/**
+ * Account for a buffer being freed. A buffer from the context is kept, so it
+ * is not freed.
+ */
+void UprightDiff::removeBufferBytes(size_t bytes) {
+	if (!m_context) {
+		m_bufferBytes -= bytes;
+	}
+}
+
+/**
+ * Release a buffer which was allocated by getBuffer()
+ */
+void UprightDiff::releaseBuffer(cv::Mat & buffer) {
+	removeBufferBytes(GetBytes(buffer));
+	buffer.release();
+}
+
+/**
+ * Wait for the intermediate images to be written
+ */
+void UprightDiff::finish() {
+	if (m_intermediateWriter) {
+		m_intermediateWriter->finish();
+	}
 }
 
 void UprightDiff::execute() {
 	m_output.totalArea = m_size.area();
 	calculateMaskArea();
+	endStage("prepare");
+	checkDeadline();
+	if (m_output.maskArea == 0) {
+		executeUnchanged();
+		endStage("residual");
+		return;
+	}
 
 	// Calculate block motion by exhaustive search
 	info() << "Searching for motion...\n";
-	Mat1i blockMotion = BlockMotionSearch::Search(m_bob, m_alice, 
-			m_options.blockSize, m_options.windowSize);
+	BlockMotionSearch::Options searchOptions;
+	searchOptions.blockSize = m_options.blockSize;
+	searchOptions.windowSize = m_options.windowSize;
+	searchOptions.threads = m_options.threads;
+	searchOptions.alignRows = m_options.alignRows;
+	searchOptions.cleanBlocks = getCleanBlocks();
+	searchOptions.deadline = m_options.deadline;
+	searchOptions.probeBudget = m_options.searchBudget;
+	Mat1i blockMotion = BlockMotionSearch::Search(m_bob, m_alice, searchOptions,
+			&m_output.search, &m_workerCpuTime);
+	if (m_output.search.degradedBlocks) {
+		m_logger.log(Logger::WARNING) << "The search budget was exceeded, so only the "
+			"predicted motion was tried for " << m_output.search.degradedBlocks << " blocks\n";
+	}
+	endStage("search");
+	checkDeadline();
 
+	// Use the compact motion field if every motion fits in it
+	if (MotionValue<int16_t>::Fits(m_size.height)) {
+		executeWithMotion<int16_t>(blockMotion);
+	} else {
+		executeWithMotion<int>(blockMotion);
+	}
+}
+
+/**
+ * Run the stages after the motion search, with a motion field of type T
+ */
+template <typename T>
+void UprightDiff::executeWithMotion(const Mat1i & blockMotion) {
 	// Scale up block motion matrix
-	m_motion = ScaleUpMotion(blockMotion, m_options.blockSize, m_size);
-	intermediateOutput("prepaint", m_motion);
+	cv::Mat_<T> motion = getBuffer<T>(&Context::motion, m_size);
+	ScaleUpMotion(blockMotion, m_options.blockSize, motion);
+	clearCleanMotion(motion);
+	intermediateOutput("prepaint", motion, true);
 
 	info() << "Expanding motion blocks\n";
 
-	// Expand block motion into sub-block NOT_FOUND regions
-	for (int y = 0; y < m_size.height; y++) {
-		// Paint right
-		paintSubBlockLine(cv::Point(0, y), cv::Point(1, 0));
-		// Paint left
-		paintSubBlockLine(cv::Point(m_size.width - 1, y), cv::Point(-1, 0));
-	}
-	for (int x = 0; x < m_size.width; x++) {
-		// Paint down
-		paintSubBlockLine(cv::Point(x, 0), cv::Point(0, 1));
-		// Paint up
-		paintSubBlockLine(cv::Point(x, m_size.height - 1), cv::Point(0, -1));
-	}
-	intermediateOutput("postpaint", m_motion);
+	// Expand block motion into sub-block NOT_FOUND regions. A line is
+	// skipped if the brush would only cover clean tiles, since they have no
+	// NOT_FOUND pixels, and painting never changes other pixels.
+	int halfWidth = (m_options.brushWidth - 1) / 2;
+	SubBlockPainter<T> painter(motion, m_alice, m_bob, m_options.brushWidth,
+			getContextBuffer(&Context::transposedMotion));
+	painter.paintRows([&](int y) {
+		return isClean(cv::Rect(0, y - halfWidth, m_size.width, m_options.brushWidth));
+	});
+	painter.paintColumns([&](int x) {
+		return isClean(cv::Rect(x - halfWidth, 0, m_options.brushWidth, m_size.height));
+	});
+	// The columns were painted on a transposed copy of the motion field,
+	// which is freed unless it is kept in the context
+	addBufferBytes(GetBytes(motion));
+	removeBufferBytes(GetBytes(motion));
+	intermediateOutput("postpaint", motion, true);
+	endStage("paint");
+	checkDeadline();
 
 	info() << "Calculating residuals\n";
 
-	visualizeResidual();
+	if (drawsInStrips()) {
+		executeInStrips(motion);
+		info() << "Done\n";
+		return;
+	}
+
+	Mat1b residualMask = visualizeResidual(motion);
+	endStage("residual");
+	checkDeadline();
+
+	// The remaining stages do not need the inputs, so free them before
+	// allocating more. For tall images, this lowers the peak memory usage.
+	m_alice.release();
+	m_bob.release();
+	removeBufferBytes(m_inputCopyBytes);
+	m_dirtyTiles.release();
 
-	info() << "Annotating motion\n";
+	if (!m_options.statsOnly) {
+		highlightResidual(residualMask);
+		releaseBuffer(residualMask);
+		endStage("highlight");
+		checkDeadline();
 
-	// Draw motion annotations
-	annotateMotion();
+		info() << "Annotating motion\n";
+
+		// Draw motion annotations. This may overwrite the motion field.
+		annotateMotion(motion);
+		endStage("annotate");
+	}
 
 	info() << "Done\n";
 }
 
-Mat3b UprightDiff::ConvertInput(const char * label, const cv::Mat & input, const cv::Size & size) {
+/**
+ * Draw the visual output in strips, passing each to the strip writer, so that
+ * after painting, the memory used depends on the width of the images and not
+ * their height. The output is the same as that of the other stages.
+ *
+ * The residual mask is found ahead of the strips for StreamingHighlighter,
+ * since whether a residual pixel is circled depends on the rows below it, and
+ * the residual of each row is then found again when its strip is drawn. The
+ * statistics of each motion region depend on all of its rows, so the regions
+ * are found first, and each strip's rows are labelled again with a
+ * MotionRegions::RowScanner.
+ */
+template <typename T>
+void UprightDiff::executeInStrips(const cv::Mat_<T> & motion) {
+	int width = m_size.width;
+	int height = m_size.height;
+	int stripHeight = getStripHeight();
+	m_output.visual.release();
+	m_output.movedArea = 0;
+	m_output.residualArea = 0;
+
+	// Plan the annotation of each region, following annotateMotion()
+	MotionRegions motionRegions = MotionRegions::FindWithoutLabels(motion);
+	const std::vector<MotionRegions::Region> & regions = motionRegions.regions();
+	std::vector<RegionAnnotation> annotations(regions.size());
+	int paletteIndex = 0;
+	int regionIndex = 0;
+	for (size_t i = 0; i < regions.size(); i++) {
+		const MotionRegions::Region & region = regions[i];
+		RegionAnnotation & annotation = annotations[i];
+		annotation.fill = region.area < MIN_CONTOUR_AREA;
+		annotation.motion = region.motion;
+		annotation.bounds = region.bounds;
+		annotation.top = region.bounds.y;
+		annotation.bottom = region.bounds.y + region.bounds.height;
+		if (annotation.fill) {
+			annotation.colour = s_palette[paletteIndex];
+			paletteIndex = (paletteIndex + 1) % 3;
+			continue;
+		}
+		annotation.colour = s_palette[regionIndex % 3];
+		regionIndex++;
+		annotation.centre = cv::Point(
+			(int)(region.sumX / region.area) + 2,
+			(int)(region.sumY / region.area) + 2);
+
+		// The arrow, with a margin for its head
+		int tipSize = std::max(3, std::abs(region.motion) / 10 + 1);
+		int arrowEnd = annotation.centre.y + region.motion;
+		annotation.top = std::min(annotation.top,
+				std::min(annotation.centre.y, arrowEnd) - tipSize - 1);
+		annotation.bottom = std::max(annotation.bottom,
+				std::max(annotation.centre.y, arrowEnd) + tipSize + 2);
+
+		cv::Point origin;
+		cv::Size textSize;
+		GetLabel(annotation.centre, region.motion, origin, textSize);
+		annotation.top = std::min(annotation.top, origin.y - textSize.height * 2);
+		annotation.bottom = std::max(annotation.bottom, origin.y + textSize.height * 2);
+	}
+	// The regions in order of their first row to draw
+	std::vector<int> byTop(regions.size());
+	for (size_t i = 0; i < byTop.size(); i++) {
+		byTop[i] = i;
+	}
+	std::stable_sort(byTop.begin(), byTop.end(), [&](int a, int b) {
+		return annotations[a].top < annotations[b].top;
+	});
+	auto nextRegion = byTop.begin();
+	std::vector<int> activeRegions;
+	MotionRegions::RowScanner<T> scanner(motionRegions, motion);
+
+	int ihw = m_options.innerHighlightWindow;
+	int circleRadius = std::min(10, ihw * 2);
+	// The furthest row from a hit which its circle can reach
+	int circleMargin = circleRadius + 3;
+	StreamingHighlighter highlighter(m_size, ihw, m_options.outerHighlightWindow,
+			getContextBuffer(&Context::residualMask),
+			getContextBuffer(&Context::highlightFlags));
+	addBufferBytes(highlighter.getBufferBytes());
+	std::vector<cv::Point> hits;
+	int maskRows = 0;
+
+	Mat3b visual = getBuffer<cv::Vec3b>(&Context::visualStrip,
+			cv::Size(width, stripHeight));
+	Mat3b contourVis = getBuffer<cv::Vec3b>(&Context::contourVis,
+			cv::Size(width, stripHeight));
+	// The regions of each row of the strip, and of the rows either side of it,
+	// which are needed for the contours
+	Mat1i regionRows = getBuffer<int>(&Context::regionLabels,
+			cv::Size(width, stripHeight + 2));
+	int regionTop = 0;
+	int scannedRows = 0;
+
+	for (int top = 0; top < height; top += stripHeight) {
+		int bottom = std::min(top + stripHeight, height);
+		Mat3b visualStrip = visual.rowRange(0, bottom - top);
+		Mat3b contourStrip = contourVis.rowRange(0, bottom - top);
+
+		// Find the residual mask ahead of the strip, until every hit whose
+		// circle can reach the strip is known
+		int neededRows = std::min(bottom + circleMargin, height);
+		while (highlighter.getCompleteRows() < neededRows) {
+			visualizeResidualRow(maskRows, motion[maskRows], nullptr,
+					highlighter.getNextRow(), nullptr);
+			highlighter.addRow();
+			maskRows++;
+		}
+		highlighter.takeHits(hits);
+
+		for (int y = top; y < bottom; y++) {
+			visualizeResidualRow(y, motion[y], nullptr, nullptr,
+					visualStrip[y - top], false);
+		}
+		for (const cv::Point & hit : hits) {
+			cv::Rect bounds(hit.x - circleMargin, hit.y - circleMargin,
+					circleMargin * 2 + 1, circleMargin * 2 + 1);
+			drawInStrip(visualStrip, top, bounds,
+				[&](Mat3b & canvas, const cv::Point & origin) {
+					cv::circle(canvas, hit - origin, circleRadius,
+							cv::Scalar(0, 0xff, 0xff), 2);
+				});
+		}
+		// Forget the hits which cannot reach the later strips
+		hits.erase(std::remove_if(hits.begin(), hits.end(),
+				[&](const cv::Point & hit) { return hit.y + circleMargin < bottom; }),
+			hits.end());
+
+		// Label the rows, keeping those which overlap the previous strip
+		int firstRow = std::max(top - 1, 0);
+		for (int y = firstRow; y < scannedRows; y++) {
+			std::copy(regionRows[y - regionTop], regionRows[y - regionTop] + width,
+					regionRows[y - firstRow]);
+		}
+		regionTop = firstRow;
+		for (; scannedRows < std::min(bottom + 1, height); scannedRows++) {
+			scanner.next(regionRows[scannedRows - regionTop]);
+		}
+
+		// Draw the regions which can reach the strip, in order
+		activeRegions.erase(std::remove_if(activeRegions.begin(), activeRegions.end(),
+				[&](int i) { return annotations[i].bottom <= top; }),
+			activeRegions.end());
+		for (; nextRegion != byTop.end() && annotations[*nextRegion].top < bottom;
+				++nextRegion)
+		{
+			if (annotations[*nextRegion].bottom > top) {
+				activeRegions.push_back(*nextRegion);
+			}
+		}
+		std::sort(activeRegions.begin(), activeRegions.end());
+		contourStrip = cv::Vec3b();
+		annotateStrip(annotations, activeRegions, regionRows, regionTop,
+				contourStrip, top);
+
+		// Blend with destination
+		for (int y = 0; y < bottom - top; y++) {
+			cv::Vec3b * visualRow = visualStrip[y];
+			const cv::Vec3b * contourRow = contourStrip[y];
+			for (int x = 0; x < width; x++) {
+				if (contourRow[x] != cv::Vec3b()) {
+					visualRow[x] = visualRow[x] / 2 + contourRow[x] / 2;
+				}
+			}
+		}
+		writeStrip(visualStrip, top);
+	}
+
+	removeBufferBytes(highlighter.getBufferBytes());
+	releaseBuffer(regionRows);
+	releaseBuffer(contourVis);
+	releaseBuffer(visual);
+	endStage("strips");
+}
+
+/**
+ * Draw the annotations of the given regions which fall within a strip of the
+ * contour image. The region of each pixel is given in regionRows, starting
+ * at row regionTop, which must cover the rows either side of the strip.
+ *
+ * Lines which are clipped by the strip are drawn from the clipped end
+ * points, which only gives the same pixels as the whole line if the line is
+ * horizontal, vertical or diagonal. The arrows and the contours only have
+ * such lines, so they are drawn directly, and the labels are drawn with
+ * drawInStrip().
+ */
+void UprightDiff::annotateStrip(const std::vector<RegionAnnotation> & annotations,
+		const std::vector<int> & regionIndexes, const Mat1i & regionRows,
+		int regionTop, Mat3b & contourStrip, int top)
+{
+	int bottom = top + contourStrip.rows;
+	cv::Point offset(0, -top);
+	for (int i : regionIndexes) {
+		const RegionAnnotation & annotation = annotations[i];
+		const cv::Rect & bounds = annotation.bounds;
+		int maskTop = std::max(top - 1, bounds.y);
+		int maskBottom = std::min(bottom + 1, bounds.y + bounds.height);
+
+		if (annotation.fill) {
+			cv::Vec3b colour(annotation.colour[0], annotation.colour[1],
+					annotation.colour[2]);
+			for (int y = std::max(top, bounds.y); y < std::min(bottom, maskBottom); y++) {
+				const int * regionRow = regionRows[y - regionTop];
+				cv::Vec3b * contourRow = contourStrip[y - top];
+				for (int x = bounds.x; x < bounds.x + bounds.width; x++) {
+					if (regionRow[x] == i) {
+						contourRow[x] = colour;
+					}
+				}
+			}
+			continue;
+		}
+
+		ArrowedLine(contourStrip,
+				annotation.centre + cv::Point(0, annotation.motion) + offset,
+				annotation.centre + offset, annotation.colour);
+
+		cv::Point origin;
+		cv::Size textSize;
+		std::string text = GetLabel(annotation.centre, annotation.motion,
+				origin, textSize);
+		cv::Rect textBounds(origin.x - textSize.height,
+				origin.y - textSize.height * 2,
+				textSize.width + textSize.height * 2,
+				textSize.height * 4);
+		drawInStrip(contourStrip, top, textBounds,
+			[&](Mat3b & canvas, const cv::Point & canvasOrigin) {
+				cv::putText(canvas, text, origin - canvasOrigin,
+						cv::FONT_HERSHEY_PLAIN, 1, annotation.colour);
+			});
+
+		// Find the contours within the rows either side of the strip, which
+		// gives the same pixels within the strip as the whole region
+		if (maskTop >= maskBottom) {
+			continue;
+		}
+		Mat1b regionMask(maskBottom - maskTop + 2, bounds.width + 2, uchar(0));
+		for (int y = maskTop; y < maskBottom; y++) {
+			const int * regionRow = regionRows[y - regionTop];
+			uchar * maskRow = regionMask[y - maskTop + 1] + 1;
+			for (int x = 0; x < bounds.width; x++) {
+				maskRow[x] = regionRow[bounds.x + x] == i ? 255 : 0;
+			}
+		}
+		std::vector<std::vector<cv::Point>> contours;
+		findContours(regionMask, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+		drawContours(contourStrip, contours, -1, annotation.colour,
+				1, 8, cv::noArray(), INT_MAX,
+				cv::Point(bounds.x - 1, maskTop - 1 - top));
+	}
+}
+
+/**
+ * Draw a shape on a strip of an image, starting at row top, in the same way
+ * as on the whole image. The shape is drawn on a blank canvas covering the
+ * given bounds within the image, and its pixels are copied to the strip. The
+ * bounds must contain the whole shape, so that the canvas only clips it where
+ * the image would. The shape must not be black.
+ */
+void UprightDiff::drawInStrip(Mat3b & strip, int top, const cv::Rect & bounds,
+		const std::function<void(Mat3b & canvas, const cv::Point & origin)> & draw)
+{
+	cv::Rect rect = bounds & cv::Rect(cv::Point(), m_size);
+	int begin = std::max(rect.y, top);
+	int end = std::min(rect.y + rect.height, top + strip.rows);
+	if (begin >= end || rect.width <= 0) {
+		return;
+	}
+	Mat3b canvas(rect.size(), cv::Vec3b());
+	draw(canvas, rect.tl());
+	for (int y = begin; y < end; y++) {
+		const cv::Vec3b * canvasRow = canvas[y - rect.y];
+		cv::Vec3b * stripRow = strip[y - top] + rect.x;
+		for (int x = 0; x < rect.width; x++) {
+			if (canvasRow[x] != cv::Vec3b()) {
+				stripRow[x] = canvasRow[x];
+			}
+		}
+	}
+}
+
+/**
+ * Pass a strip of the visual output to the strip writer
+ */
+void UprightDiff::writeStrip(const Mat3b & strip, int top) {
+	if (m_options.stripWriter) {
+		m_options.stripWriter(strip, top, m_size);
+	}
+	checkDeadline();
+}
+
+/**
+ * Throw an exception if the deadline has passed. This is checked between
+ * stages, and by the motion search between rows of blocks.
+ */
+void UprightDiff::checkDeadline() {
+	if (std::chrono::steady_clock::now() >= m_options.deadline) {
+		throw std::runtime_error("The deadline was exceeded");
+	}
+}
+
+Mat3b UprightDiff::convertInput(const char * label, const cv::Mat & input,
+		cv::Mat Context::* buffer)
+{
+	const cv::Size & size = m_size;
 	if (input.type() != CV_8UC3) {
 		throw std::runtime_error(std::string("The ") + label +
 				" image is invalid or has the wrong pixel type\n");
 	}
-	Mat3b ret(size, cv::Vec3b(128, 128, 128));
-	input.copyTo(ret(cv::Rect(cv::Point(), input.size())));
+	if (input.size() == size) {
+		// The pipeline only reads the inputs, so the caller's buffer can be
+		// used directly
+		return Mat3b(input);
+	}
+
+	// Copy the input to the top left, and fill only the missing strips
+	// with grey
+	Mat3b ret = getBuffer<cv::Vec3b>(buffer, size);
+	m_inputCopyBytes += GetBytes(ret);
+	const cv::Vec3b grey(128, 128, 128);
+	for (int y = 0; y < size.height; y++) {
+		cv::Vec3b * destRow = ret[y];
+		int x = 0;
+		if (y < input.rows) {
+			const cv::Vec3b * sourceRow = input.ptr<cv::Vec3b>(y);
+			std::copy(sourceRow, sourceRow + input.cols, destRow);
+			x = input.cols;
+		}
+		std::fill(destRow + x, destRow + size.width, grey);
+	}
 	return ret;
 }
 
+/**
+ * Count the pixels which differ between the inputs, and build the map of
+ * dirty tiles. Most of a typical screenshot is unchanged, and later stages
+ * skip the clean tiles.
+ */
 void UprightDiff::calculateMaskArea() {
-	Mat1b mask(m_size, 0);
+	int blockSize = m_options.blockSize;
+	m_tileSize = (TILE_SIZE + blockSize - 1) / blockSize * blockSize;
+	m_dirtyTiles = Mat1b(
+			(m_size.height + m_tileSize - 1) / m_tileSize,
+			(m_size.width + m_tileSize - 1) / m_tileSize,
+			uchar(0));
+
+	// The mask itself is only needed for the intermediate output
+	Mat1b mask;
+	if (hasIntermediateOutput()) {
+		mask = Mat1b(m_size, uchar(0));
+	}
+	m_output.maskArea = 0;
 	for (int y = 0; y < m_size.height; y++) {
-		for (int x = 0; x < m_size.width; x++) {
-			if (m_alice(y, x) != m_bob(y, x)) {
-				mask(y, x) = 255;
+		const cv::Vec3b * aliceRow = m_alice[y];
+		const cv::Vec3b * bobRow = m_bob[y];
+		uchar * dirtyRow = m_dirtyTiles[y / m_tileSize];
+		for (int tileX = 0; tileX < m_size.width; tileX += m_tileSize) {
+			int end = std::min(tileX + m_tileSize, m_size.width);
+			if (!memcmp(aliceRow + tileX, bobRow + tileX, (end - tileX) * sizeof(cv::Vec3b))) {
+				continue;
+			}
+			dirtyRow[tileX / m_tileSize] = 1;
+			for (int x = tileX; x < end; x++) {
+				if (aliceRow[x] != bobRow[x]) {
+					m_output.maskArea++;
+					if (!mask.empty()) {
+						mask(y, x) = 255;
+					}
+				}
 			}
 		}
 	}
 	intermediateOutput("mask", mask);
-	m_output.maskArea = cv::countNonZero(mask);
-}
-
-Mat1i UprightDiff::ScaleUpMotion(Mat1i & blockMotion, int blockSize, const cv::Size & destSize) {
-	Mat1i motion(destSize);
-	Mat1i notFound(1, 1, NOT_FOUND);
-	int x, y, xIndex, yIndex;
-	for (y = 0, yIndex = 0; yIndex < blockMotion.rows; yIndex++, y += blockSize) {
-		for (x = 0, xIndex = 0; xIndex < blockMotion.cols; xIndex++, x += blockSize) {
-			cv::Rect sourceRect(xIndex, yIndex, 1, 1);
-			cv::Rect destRect(xIndex * blockSize, yIndex * blockSize, blockSize, blockSize);
-			cv::repeat(blockMotion(sourceRect), blockSize, blockSize, motion(destRect));
+}
+
+/**
+ * Produce the output for identical inputs: no motion, no residuals, and all
+ * pixels faded to grey.
+ */
+void UprightDiff::executeUnchanged() {
+	info() << "The images are identical\n";
+	m_output.movedArea = 0;
+	m_output.residualArea = 0;
+	if (m_options.statsOnly) {
+		m_output.visual.release();
+		return;
+	}
+	if (drawsInStrips()) {
+		m_output.visual.release();
+		Mat3b strip = getBuffer<cv::Vec3b>(&Context::visualStrip,
+				cv::Size(m_size.width, getStripHeight()));
+		for (int top = 0; top < m_size.height; top += strip.rows) {
+			int bottom = std::min(top + strip.rows, m_size.height);
+			for (int y = top; y < bottom; y++) {
+				for (int x = 0; x < m_size.width; x++) {
+					strip(y - top, x) = BgrToFadedGreyBgr(m_bob(y, x));
+				}
+			}
+			writeStrip(strip.rowRange(0, bottom - top), top);
 		}
-		cv::Rect edgeRect(x, y, destSize.width - x, blockSize);
-		if (edgeRect.width > 0) {
-			cv::repeat(notFound, edgeRect.height, edgeRect.width, motion(edgeRect));
+		releaseBuffer(strip);
+		return;
+	}
+	Mat3b & visual = createVisual();
+	for (int y = 0; y < m_size.height; y++) {
+		for (int x = 0; x < m_size.width; x++) {
+			visual(y, x) = BgrToFadedGreyBgr(m_bob(y, x));
 		}
 	}
+}
+
+cv::Rect UprightDiff::getTileRect(int xIndex, int yIndex) {
+	return cv::Rect(xIndex * m_tileSize, yIndex * m_tileSize, m_tileSize, m_tileSize)
+		& cv::Rect(cv::Point(), m_size);
+}
 
-	{
-		cv::Rect edgeRect(0, y, destSize.width, destSize.height - y);
-		if (edgeRect.height > 0) {
-			cv::repeat(notFound, edgeRect.height, edgeRect.width, motion(edgeRect));
+/**
+ * Determine whether all tiles intersecting the given rectangle are clean.
+ * The rectangle may extend outside the image.
+ */
+bool UprightDiff::isClean(const cv::Rect & rect) {
+	cv::Rect clipped = rect & cv::Rect(cv::Point(), m_size);
+	if (clipped.area() == 0) {
+		return true;
+	}
+	int top = clipped.y / m_tileSize;
+	int bottom = (clipped.y + clipped.height - 1) / m_tileSize;
+	int left = clipped.x / m_tileSize;
+	int right = (clipped.x + clipped.width - 1) / m_tileSize;
+	for (int yIndex = top; yIndex <= bottom; yIndex++) {
+		for (int xIndex = left; xIndex <= right; xIndex++) {
+			if (m_dirtyTiles(yIndex, xIndex)) {
+				return false;
+			}
 		}
 	}
-	return motion;
+	return true;
 }
 
-void UprightDiff::paintSubBlockLine(const cv::Point & start, const cv::Point & step) {
-	int halfWidth = (m_options.brushWidth - 1) / 2;
-	cv::Point brushStep(step.y, step.x);
-	cv::Point halfWidthVector = halfWidth * brushStep;
-	cv::Point pos = start;
-	cv::Rect bounds(cv::Point(), m_motion.size());
-	int prevConsensus = NOT_FOUND;
-	while (bounds.contains(pos)) {
-		cv::Rect roiRect(pos - halfWidthVector, pos + halfWidthVector + cv::Point(1, 1));
-		if ((roiRect & bounds) != roiRect) {
-			break;
+/**
+ * Get the map of blocks which lie in clean tiles, for the motion search
+ */
+Mat1b UprightDiff::getCleanBlocks() {
+	int blockSize = m_options.blockSize;
+	Mat1b cleanBlocks(m_size.height / blockSize, m_size.width / blockSize);
+	for (int yIndex = 0; yIndex < cleanBlocks.rows; yIndex++) {
+		for (int xIndex = 0; xIndex < cleanBlocks.cols; xIndex++) {
+			cleanBlocks(yIndex, xIndex) = !m_dirtyTiles(
+				yIndex * blockSize / m_tileSize,
+				xIndex * blockSize / m_tileSize);
 		}
-		cv::Mat1i roiBlock = m_motion(roiRect);
-
-		// Paint the current step
-		if (prevConsensus != NOT_FOUND && prevConsensus != INVALID) {
-			int curConsensus = GetWeakConsensus(roiBlock);
-			if (curConsensus == NOT_FOUND || curConsensus == prevConsensus) {
-				for (int b = -halfWidth; b <= halfWidth; b++) {
-					cv::Point srcPos = pos + b * brushStep;
-					cv::Point destPos = srcPos + cv::Point(0, prevConsensus);
-					if (bounds.contains(destPos) && m_bob(srcPos) == m_alice(destPos)) {
-						m_motion.at<int>(srcPos) = prevConsensus;
-					}
-				}
+	}
+	return cleanBlocks;
+}
+
+/**
+ * Set the motion of all pixels in clean tiles to zero. This includes the
+ * edges of the image which are not covered by the block search.
+ */
+template <typename T>
+void UprightDiff::clearCleanMotion(cv::Mat_<T> & motion) {
+	for (int yIndex = 0; yIndex < m_dirtyTiles.rows; yIndex++) {
+		for (int xIndex = 0; xIndex < m_dirtyTiles.cols; xIndex++) {
+			if (!m_dirtyTiles(yIndex, xIndex)) {
+				motion(getTileRect(xIndex, yIndex)) = 0;
 			}
 		}
-
-		prevConsensus = GetStrongConsensus(roiBlock);
-		GetStrongConsensus(roiBlock);
-		pos += step;
 	}
 }
 
-uchar UprightDiff::BgrToGrey(const cv::Vec3b & bgr) {
-	return cv::saturate_cast<uchar>(
-			76 * bgr[2] / 255     // Blue
-			+ 150 * bgr[1] / 255  // Green
-			+ 29 * bgr[0] / 255); // Red
+/**
+ * Get a buffer of the given size. If there is a context, the buffer is shared
+ * with it, and its previous allocation is reused if it is large enough. The
+ * contents are undefined.
+ */
+template <typename T>
+cv::Mat_<T> UprightDiff::getBuffer(cv::Mat Context::* buffer, const cv::Size & size) {
+	cv::Mat_<T> ret;
+	if (m_context) {
+		cv::Mat & pooled = m_context->*buffer;
+		pooled.create(size, cv::DataType<T>::type);
+		ret = pooled;
+	} else {
+		ret.create(size);
+	}
+	addBufferBytes(GetBytes(ret));
+	return ret;
 }
 
-cv::Vec3b UprightDiff::BgrToFadedGreyBgr(const cv::Vec3b & bgr) {
-	uchar value = 127 + BgrToGrey(bgr) / 2;
-	return cv::Vec3b(value, value, value);
+/**
+ * Get a buffer for a helper class to create, or null if there is no context
+ */
+cv::Mat * UprightDiff::getContextBuffer(cv::Mat Context::* buffer) {
+	return m_context ? &(m_context->*buffer) : nullptr;
 }
 
 /**
- * Get the value of all elements in the block, or INVALID if they are not all
- * the same.
+ * Create the visual output. With a context, the caller's previous output is
+ * reused if it has the right size.
  */
-int UprightDiff::GetStrongConsensus(const cv::Mat1i & block) {
-	int consensus = block(0, 0);
-	for (int y = 0; y < block.rows; y++) {
-		for (int x = 0; x < block.cols; x++) {
-			if (block(y, x) != consensus) {
-				return INVALID;
-			}
-		}
+Mat3b & UprightDiff::createVisual() {
+	if (m_context) {
+		m_output.visual.create(m_size);
+	} else {
+		m_output.visual = Mat3b(m_size);
 	}
-	return consensus;
+	addBufferBytes(GetBytes(m_output.visual));
+	return m_output.visual;
 }
 
 /**
- * Get the value of all elements of the block, or INVALID if they are not all
- * the same, except for NOT_FOUND elements which are ignored. If all elements
- * are NOT_FOUND, NOT_FOUND is returned.
+ * Expand each block motion value to cover its block, with NOT_FOUND in the
+ * partial blocks at the right and bottom edges. This is done in a single pass
+ * over the output: the first row of each block row is expanded from the block
+ * motion, and each other row is a copy of the row above. The output size is
+ * the size of the given motion field.
  */
-int UprightDiff::GetWeakConsensus(const cv::Mat1i & block) {
-	int consensus = NOT_FOUND;
-	for (int y = 0; y < block.rows; y++) {
-		for (int x = 0; x < block.cols; x++) {
-			int v = block(y, x);
-			if (v != consensus && v != NOT_FOUND) {
-				return INVALID;
-			}
-			if (v != NOT_FOUND) {
-				consensus = v;
+template <typename T>
+void UprightDiff::ScaleUpMotion(const Mat1i & blockMotion, int blockSize,
+		cv::Mat_<T> & motion)
+{
+	cv::Size destSize = motion.size();
+	for (int y = 0; y < destSize.height; y++) {
+		T * destRow = motion[y];
+		if (y % blockSize != 0) {
+			std::copy(motion[y - 1], motion[y - 1] + destSize.width, destRow);
+			continue;
+		}
+		int yIndex = y / blockSize;
+		int x = 0;
+		if (yIndex < blockMotion.rows) {
+			const int * sourceRow = blockMotion[yIndex];
+			for (int xIndex = 0; xIndex < blockMotion.cols; xIndex++) {
+				int value = sourceRow[xIndex];
+				std::fill(destRow + x, destRow + x + blockSize,
+					value == NOT_FOUND ? MotionValue<T>::NOT_FOUND : (T)value);
+				x += blockSize;
 			}
 		}
+		std::fill(destRow + x, destRow + destSize.width, MotionValue<T>::NOT_FOUND);
+	}
+}
+
+const UprightDiff::GreyTable UprightDiff::s_greyTable;
+
+UprightDiff::GreyTable::GreyTable() {
+	for (int i = 0; i < 256; i++) {
+		channels[0][i] = 29 * i / 255;  // Blue
+		channels[1][i] = 150 * i / 255; // Green
+		channels[2][i] = 76 * i / 255;  // Red
 	}
-	return consensus;
 }
 
-Mat3b UprightDiff::visualizeResidual() {
-	// Prepare moved image
-	Mat3b moved(m_size, cv::Vec3b(255, 0, 255));
+uchar UprightDiff::BgrToGrey(const cv::Vec3b & bgr) {
+	// The coefficients sum to 255, so this cannot overflow
+	return s_greyTable.channels[0][bgr[0]]
+		+ s_greyTable.channels[1][bgr[1]]
+		+ s_greyTable.channels[2][bgr[2]];
+}
+
+cv::Vec3b UprightDiff::BgrToFadedGreyBgr(const cv::Vec3b & bgr) {
+	uchar value = 127 + BgrToGrey(bgr) / 2;
+	return cv::Vec3b(value, value, value);
+}
+
+/**
+ * Count the moved and residual pixels, and unless only the statistics are
+ * needed, draw the residual visualisation. Return the mask of residual
+ * pixels, which is empty if only the statistics are needed.
+ */
+template <typename T>
+Mat1b UprightDiff::visualizeResidual(const cv::Mat_<T> & motion) {
+	// The moved image is only needed for the intermediate output
+	Mat3b moved;
+	if (hasIntermediateOutput()) {
+		moved = Mat3b(m_size);
+	}
+	Mat1b residualMask;
+	if (m_options.statsOnly) {
+		m_output.visual.release();
+	} else {
+		createVisual();
+		residualMask = getBuffer<uchar>(&Context::residualMask, m_size);
+		residualMask = uchar(0);
+	}
 	m_output.movedArea = 0;
+	m_output.residualArea = 0;
 	for (int y = 0; y < m_size.height; y++) {
-		for (int x = 0; x < m_size.width; x++) {
-			int dy = m_motion(y, x);
-			if (dy != NOT_FOUND) {
-				if (dy != 0) {
-					m_output.movedArea++;
-				}
-				if (y + dy >= moved.rows || y + dy < 0) {
-					throw std::runtime_error(
-						"Error: out of bounds: (" +
-						std::to_string(x) +
-						", " +
-						std::to_string(y) +
-						" + " +
-						std::to_string(dy) +
-						")\n");
-				}
-				moved(y, x) = m_alice(y + dy, x);
-			}
-		}
+		visualizeResidualRow(y, motion[y],
+				moved.empty() ? nullptr : moved[y],
+				residualMask.empty() ? nullptr : residualMask[y],
+				m_output.visual.empty() ? nullptr : m_output.visual[y]);
 	}
 	intermediateOutput("moved", moved);
+	if (!m_options.statsOnly) {
+		intermediateOutput("residual-mask", residualMask, true);
+		intermediateOutput("plain-residual", m_output.visual, true);
+	}
+	return residualMask;
+}
 
-	// Compute residual visualisation
-	m_output.visual = Mat3b(m_size, cv::Vec3b(128, 128, 128));
+/**
+ * Circle the isolated residual pixels, which are those where all residual
+ * pixels within the outer window are within the inner window. The mask is
+ * modified.
+ */
+void UprightDiff::highlightResidual(Mat1b & residualMask) {
 	Mat3b & visual = m_output.visual;
-	m_output.residualArea = 0;
-	Mat1b residualMask(m_size, uchar(0));
-	for (int y = 0; y < m_size.height; y++) {
-		for (int x = 0; x < m_size.width; x++) {
-			if (moved(y, x) == m_bob(y, x)) {
-				visual(y, x) = BgrToFadedGreyBgr(moved(y, x));
-			} else if (m_motion(y, x) == NOT_FOUND) {
-				cv::Vec3b ac = m_alice(y, x);
-				cv::Vec3b bc = m_bob(y, x);
-				if (ac == bc) {
-					visual(y, x) = BgrToFadedGreyBgr(ac);
-				} else {
-					visual(y, x) = cv::Vec3b(0, BgrToGrey(bc), BgrToGrey(ac));
-					m_output.residualArea ++;
-					residualMask(y, x) = 1;
+	int ihw = m_options.innerHighlightWindow;
+	ResidualHighlighter highlighter(residualMask, ihw,
+			m_options.outerHighlightWindow, m_options.threads,
+			getContextBuffer(&Context::highlightTable),
+			getContextBuffer(&Context::highlightFlags));
+	std::vector<cv::Point> points = highlighter.find();
+	// The working buffers are freed by find() unless they are kept in the
+	// context
+	addBufferBytes(highlighter.getBufferBytes());
+	removeBufferBytes(highlighter.getBufferBytes());
+	m_workerCpuTime += highlighter.getWorkerCpuTime();
+	for (const cv::Point & point : points) {
+		cv::circle(visual, point,
+				std::min(10, ihw * 2),
+				cv::Scalar(0, 0xff, 0xff), 2);
+	}
+	intermediateOutput("circled-residual", visual, true);
+}
 
-				}
-			} else {
-				cv::Vec3b mc = moved(y, x);
-				cv::Vec3b bc = m_bob(y, x);
-				visual(y, x) = cv::Vec3b(0, BgrToGrey(bc), BgrToGrey(mc));
-				m_output.residualArea ++;
-				residualMask(y, x) = 1;
+/**
+ * Apply the motion to a row of the first image, and compare the result with
+ * the second image, counting the moved and residual pixels unless count is
+ * false. Residual pixels are marked in residualRow, the residual
+ * visualisation is written to visualRow, and the moved image is written to
+ * movedRow, for each of them which is not null.
+ */
+template <typename T>
+void UprightDiff::visualizeResidualRow(int y, const T * motionRow, cv::Vec3b * movedRow,
+		uchar * residualRow, cv::Vec3b * visualRow, bool count)
+{
+	const T notFound = MotionValue<T>::NOT_FOUND;
+	const cv::Vec3b notFoundColour(255, 0, 255);
+	const cv::Vec3b * aliceRow = m_alice[y];
+	const cv::Vec3b * bobRow = m_bob[y];
+	const uchar * dirtyRow = m_dirtyTiles[y / m_tileSize];
+
+	for (int x = 0; x < m_size.width; x++) {
+		if (!dirtyRow[x / m_tileSize]) {
+			// Skip to the end of the clean tile, which has zero motion and no
+			// residual
+			int end = std::min(x + m_tileSize, m_size.width);
+			if (movedRow) {
+				std::copy(aliceRow + x, aliceRow + end, movedRow + x);
+			}
+			for (; visualRow && x < end; x++) {
+				visualRow[x] = BgrToFadedGreyBgr(bobRow[x]);
 			}
+			x = end - 1;
+			continue;
 		}
-	}
-	intermediateOutput("residual-mask", residualMask);
-	intermediateOutput("plain-residual", visual);
 
-	// Highlight isolated residual pixels
-	// This is done by maintaining a count of the number of residual pixels in
-	// two concentric blocks. As the block moves, we subtract the row that left
-	// the block, and add the row that entered the block. This is done in
-	// column-major order so that the rows being added or subtracted are
-	// contiguous in memory.
-	int ihw = m_options.innerHighlightWindow;
-	int ihw2 = (ihw - 1) / 2;
-	int ohw = m_options.outerHighlightWindow;
-	for (int cx = 0; cx < m_size.width; cx++) {
-		RollingBlockCounter<Mat1b> innerCounter(residualMask, cx, ihw);
-		RollingBlockCounter<Mat1b> outerCounter(residualMask, cx, ohw);
-		
-		for (int cy = 0; cy < m_size.height; cy++) {
-			int innerCount = innerCounter(cy);
-			int outerCount = outerCounter(cy);
-			if (innerCount != 0 && innerCount == outerCount) {
-				cv::circle(visual, cv::Point(cx, cy),
-						std::min(10, ihw * 2),
-						cv::Scalar(0, 0xff, 0xff), 2);
-				cv::Rect innerRect(
-					cv::Point(
-						std::max(cx - ihw2, 0),
-						std::max(cy - ihw2, 0)
-					),
-					cv::Point(
-						std::min(cx + ihw2 + 1, m_size.width),
-						std::min(cy + ihw2 + 1, m_size.height)
-					)
-				);
-				residualMask(innerRect) = 0;
-				innerCounter.purge();
-				outerCounter.purge();
+		int dy = motionRow[x];
+		cv::Vec3b bc = bobRow[x];
+		cv::Vec3b mc;
+		if (dy == notFound) {
+			mc = notFoundColour;
+		} else {
+			if (dy != 0 && count) {
+				m_output.movedArea++;
+			}
+			if (y + dy >= m_size.height || y + dy < 0) {
+				throw std::runtime_error(
+					"Error: out of bounds: (" +
+					std::to_string(x) +
+					", " +
+					std::to_string(y) +
+					" + " +
+					std::to_string(dy) +
+					")\n");
+			}
+			mc = m_alice(y + dy, x);
+		}
+		if (movedRow) {
+			movedRow[x] = mc;
+		}
+
+		if (mc == bc) {
+			if (visualRow) {
+				visualRow[x] = BgrToFadedGreyBgr(mc);
+			}
+		} else if (dy == notFound && aliceRow[x] == bc) {
+			if (visualRow) {
+				visualRow[x] = BgrToFadedGreyBgr(bc);
+			}
+		} else {
+			if (count) {
+				m_output.residualArea++;
+			}
+			if (residualRow) {
+				residualRow[x] = 1;
+			}
+			if (visualRow) {
+				// For NOT_FOUND, compare against the unmoved first image
+				cv::Vec3b oc = dy == notFound ? aliceRow[x] : mc;
+				visualRow[x] = cv::Vec3b(0, BgrToGrey(bc), BgrToGrey(oc));
 			}
 		}
 	}
-	intermediateOutput("circled-residual", visual);
-	return visual;
 }
 
-void UprightDiff::annotateMotion() {
-	Mat3b contourVis(m_output.visual.size(), cv::Vec3b());
+template <typename T>
+void UprightDiff::annotateMotion(cv::Mat_<T> & motion) {
+	Mat3b contourVis = getBuffer<cv::Vec3b>(&Context::contourVis, m_output.visual.size());
+	contourVis = cv::Vec3b();
 
-	std::vector<cv::Scalar> palette;
-	palette.push_back(cv::Scalar(0xff, 0x00, 0x00));
-	palette.push_back(cv::Scalar(0xff, 0x80, 0x00));
-	palette.push_back(cv::Scalar(0xff, 0x00, 0x80));
 	int paletteIndex = 0;
 
-	// Find motion regions by flood filling
-	Mat1i motion(cv::Size(m_motion.cols + 2, m_motion.rows + 2), NOT_FOUND);
-	m_motion.copyTo(motion(cv::Rect(cv::Point(1, 1), m_motion.size())));
+	// Find motion regions
+	MotionRegions motionRegions(motion, getContextBuffer(&Context::regionLabels));
+	// The labels are written over a motion field of int, but need a buffer
+	// for a smaller motion field
+	size_t labelBytes = sizeof(T) < sizeof(int) ? m_size.area() * sizeof(int) : 0;
+	addBufferBytes(labelBytes);
+	const std::vector<MotionRegions::Region> & regions = motionRegions.regions();
 	int regionIndex = 0;
-	Mat1b mask(cv::Size(motion.cols + 2, motion.rows + 2), uchar(0));
-	const int minArea = 50;
-	for (int y = 1; y < motion.rows - 1; y++) {
-		for (int x = 1; x < motion.cols - 1; x++) {
-			if (mask(y + 1, x + 1)) {
-				continue;
-			}
-			int currentMotion = motion(y, x);
-			if (currentMotion == 0 || currentMotion == NOT_FOUND) {
-				continue;
-			}
-			int area = floodFill(
-					motion,
-					mask,
-					cv::Point(x, y), // seedPoint
-					cv::Scalar(), // newVal
-					nullptr, // rect
-					cv::Scalar(), // loDiff
-					cv::Scalar(), // upDiff
-					4  // connectivity
-					| (2 << 8) // mask value
-					| cv::FLOODFILL_MASK_ONLY
-					);
-			Mat1b currentMask = (mask == 2);
-			if (area < minArea) {
-				// Too small for contour, fill instead
-				contourVis.setTo(palette[paletteIndex],
-					currentMask(cv::Rect(cv::Point(2, 2), mask.size() - cv::Size(4, 4))));
-				paletteIndex = (paletteIndex + 1) % palette.size();
-			} else {
-				// Draw arrow
-				cv::Point centrePoint = FindMaskCentre(mask, area);
-				cv::Scalar colour = palette[regionIndex % palette.size()];
-				ArrowedLine(contourVis, centrePoint + cv::Point(0, currentMotion),
-						centrePoint, colour);
-
-				// Draw arrow label
-				std::string text = std::to_string(std::abs(currentMotion));
-				cv::Size textSize = cv::getTextSize(text, cv::FONT_HERSHEY_PLAIN,
-						1, 1, nullptr);
-				cv::putText(contourVis, text,
-						centrePoint + cv::Point(2, currentMotion / 2 + textSize.height / 2),
-						cv::FONT_HERSHEY_PLAIN,	1, colour);
-
-				// Find and draw contours
-				std::vector<std::vector<cv::Point>> contours;
-				findContours(currentMask, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
-				drawContours(contourVis, contours, -1, colour,
-						1, 8, cv::noArray(), INT_MAX, cv::Point(-2, -2));
-				regionIndex++;
-			}
-			// Mark done areas
-			mask.setTo(1, currentMask);
+	for (size_t i = 0; i < regions.size(); i++) {
+		const MotionRegions::Region & region = regions[i];
+		int currentMotion = region.motion;
+		if (region.area < MIN_CONTOUR_AREA) {
+			// Too small for contour, fill instead
+			contourVis(region.bounds).setTo(s_palette[paletteIndex],
+				motionRegions.getMask(i));
+			paletteIndex = (paletteIndex + 1) % 3;
+		} else {
+			// Draw arrow. The centre was originally found in the coordinates
+			// of the flood fill mask, which were offset by two pixels, and
+			// this is kept so that the output does not change.
+			cv::Point centrePoint(
+				(int)(region.sumX / region.area) + 2,
+				(int)(region.sumY / region.area) + 2);
+			cv::Scalar colour = s_palette[regionIndex % 3];
+			ArrowedLine(contourVis, centrePoint + cv::Point(0, currentMotion),
+					centrePoint, colour);
+
+			// Draw arrow label
+			cv::Point origin;
+			cv::Size textSize;
+			std::string text = GetLabel(centrePoint, currentMotion, origin, textSize);
+			cv::putText(contourVis, text, origin, cv::FONT_HERSHEY_PLAIN, 1, colour);
+
+			// Find and draw contours, within the bounding box plus the
+			// one-pixel border which findContours() ignores
+			Mat1b regionMask = motionRegions.getMask(i, 1);
+			std::vector<std::vector<cv::Point>> contours;
+			findContours(regionMask, contours, cv::RETR_LIST, cv::CHAIN_APPROX_SIMPLE);
+			drawContours(contourVis, contours, -1, colour,
+					1, 8, cv::noArray(), INT_MAX, region.bounds.tl() - cv::Point(1, 1));
+			regionIndex++;
 		}
 	}
 
@@ -391,21 +994,28 @@ void UprightDiff::annotateMotion() {
 			}
 		}
 	}
+	removeBufferBytes(labelBytes);
+	releaseBuffer(contourVis);
 }
 
-cv::Point UprightDiff::FindMaskCentre(const Mat1b & mask, int totalArea) {
-	int sumX = 0, sumY = 0;
-	for (int y = 0; y < mask.rows; y++) {
-		for (int x = 0; x < mask.cols; x++) {
-			if (mask(y, x) == 2) {
-				sumX += x;
-				sumY += y;
-			}
-		}
-	}
-	return cv::Point(sumX / totalArea, sumY / totalArea);
-}
+const cv::Scalar UprightDiff::s_palette[3] = {
+	cv::Scalar(0xff, 0x00, 0x00),
+	cv::Scalar(0xff, 0x80, 0x00),
+	cv::Scalar(0xff, 0x00, 0x80)
+};
 
+/**
+ * Get the label of a region's arrow, the point at which it is drawn, and its
+ * size
+ */
+std::string UprightDiff::GetLabel(const cv::Point & centre, int motion,
+		cv::Point & origin, cv::Size & size)
+{
+	std::string text = std::to_string(std::abs(motion));
+	size = cv::getTextSize(text, cv::FONT_HERSHEY_PLAIN, 1, 1, nullptr);
+	origin = centre + cv::Point(2, motion / 2 + size.height / 2);
+	return text;
+}
 
 /**
  * Draw an arrowed line, similar to cv::arrowedLine()
@@ -435,35 +1045,14 @@ void UprightDiff::intermediateOutput(const char* label, const cv::MatExpr & expr
 	}
 }
 
-cv::Mat UprightDiff::convertIntermediate(const cv::Mat & m) {
-	if (m.type() != CV_32S) {
-		return m;
-	}
-	Mat3b out(m.size());
-	for (int y = 0; y < m.rows; y++) {
-		for (int x = 0; x < m.cols; x++) {
-			int dy = m.at<int>(y, x);
-			cv::Vec3b color;
-			if (dy == NOT_FOUND) {
-				color = cv::Vec3b(255, 255, 255);
-			} else {
-				if (dy < -127) {
-					dy = -127;
-				} else if (dy > 127) {
-					dy = 127;
-				}
-				color = cv::Vec3b(128 + dy, 0, 128 - dy);
-			}
-			out(y, x) = color;
-		}
-	}
-	return out;
-}
-
-void UprightDiff::intermediateOutput(const char* label, const cv::Mat & m) {
-	if (m_options.intermediateDir.empty()) {
+/**
+ * Queue an intermediate image to be written in the background. The image is
+ * shared with the writer, so if the caller will modify it later, copy must
+ * be true.
+ */
+void UprightDiff::intermediateOutput(const char* label, const cv::Mat & m, bool copy) {
+	if (!m_intermediateWriter) {
 		return;
 	}
-	cv::Mat out = convertIntermediate(m);
-	cv::imwrite(m_options.intermediateDir + "/" + label + ".png", out);
+	m_intermediateWriter->write(label, copy ? m.clone() : m);
 }
@@ -1,6 +1,17 @@
+#ifndef UPRIGHTDIFF_H
+#define UPRIGHTDIFF_H
+
+#include <chrono>
+#include <functional>
 #include <limits>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
 #include "Logger.h"
+#include "SearchCounters.h"
+
+class IntermediateWriter;
 
 class UprightDiff {
 public:
@@ -15,18 +26,67 @@ public:
 		int brushWidth = 9;
 		int outerHighlightWindow = 21;
 		int innerHighlightWindow = 5;
+		int threads = 1;
+		bool alignRows = true;
+
+		// The number of block comparisons after which the motion search only
+		// tries the predicted motion of each block, or zero for no limit.
+		// This bounds the search time on inputs such as noise, which have
+		// few matches.
+		long long searchBudget = 0;
+
+		// Only calculate the statistics, leaving Output::visual empty. This
+		// skips all drawing, and is faster.
+		bool statsOnly = false;
+
+		// If nonzero, the visual output is drawn in strips of this many rows,
+		// which are passed in order to stripWriter, and Output::visual is
+		// left empty. The output is the same, but after painting, the memory
+		// used depends on the width of the images and not their height.
+		// Intermediate images cannot be written in this mode.
+		int stripHeight = 0;
+
+		// Receives each strip, with the index of its first row and the size
+		// of the whole visual output
+		std::function<void(const Mat3b & strip, int y, const cv::Size & size)> stripWriter;
+
 		std::string intermediateDir;
 		std::ostream * logStream = nullptr;
 		int logLevel = Logger::FATAL;
 		bool logTimestamp = false;
+
+		// If this time is reached before the diff is complete, Diff() throws
+		// a std::runtime_error
+		std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::time_point::max();
 	};
 
 	struct Output {
+		struct StageTiming {
+			std::string stage;
+			// The wall time in milliseconds
+			double wallTime;
+			// The CPU time in milliseconds of the calling thread and of the
+			// worker threads started by the stage
+			double cpuTime;
+		};
+
 		int totalArea = 0;
 		int maskArea = 0;
 		int movedArea = 0;
 		int residualArea = 0;
 		Mat3b visual;
+
+		// The time taken by each stage, in the order they ran
+		std::vector<StageTiming> timings;
+
+		// The peak total size of the image-sized buffers allocated by the
+		// diff. This does not include the caller's inputs, the motion
+		// search's index or the intermediate images.
+		size_t peakBufferBytes = 0;
+
+		// The work done by the motion search
+		SearchCounters search;
 	};
 
 	enum {
@@ -34,31 +94,164 @@ public:
 		INVALID = NOT_FOUND - 1
 	};
 
+	// The approximate size of the tiles used to skip unchanged regions
+	enum {TILE_SIZE = 64};
+
+	/**
+	 * Buffers which are kept between calls to Diff(), so that diffing many
+	 * images of the same size does not allocate them each time. The buffers
+	 * are resized as needed. Since they are held for the whole call, the
+	 * peak memory usage is higher than Diff() without a context. A context
+	 * may only be used by one call at a time.
+	 */
+	class Context {
+	public:
+		/**
+		 * Free the buffers
+		 */
+		void clear() {
+			*this = Context();
+		}
+
+	private:
+		friend class UprightDiff;
+
+		// The inputs, if they need to be extended to the common size
+		cv::Mat alice;
+		cv::Mat bob;
+
+		// The motion field, and its transposed copy used while painting
+		cv::Mat motion;
+		cv::Mat transposedMotion;
+
+		cv::Mat residualMask;
+		cv::Mat highlightTable;
+		cv::Mat highlightFlags;
+		cv::Mat regionLabels;
+		cv::Mat contourVis;
+
+		// The strip of the visual output, when it is drawn in strips
+		cv::Mat visualStrip;
+	};
+
 	static void Diff(const cv::Mat & alice, const cv::Mat & bob, const Options & options,
 			Output & output);
 
+	/**
+	 * Diff two images, reusing the buffers in the context. The result is the
+	 * same as Diff() without a context. Output::visual is also reused if it
+	 * has the right size, so the caller must copy it if it is needed after
+	 * the next call.
+	 */
+	static void Diff(const cv::Mat & alice, const cv::Mat & bob, const Options & options,
+			Output & output, Context & context);
+
 private:
 	UprightDiff(const cv::Mat & alice, const cv::Mat & bob, const Options & options,
-			Output & output);
+			Output & output, Context * context);
 
 	void execute();
+	void finish();
+	void endStage(const char * stage);
+	void addBufferBytes(size_t bytes);
+	void removeBufferBytes(size_t bytes);
+	void releaseBuffer(cv::Mat & buffer);
+
+	static size_t GetBytes(const cv::Mat & m) {
+		return m.total() * m.elemSize();
+	}
+
+	template <typename T>
+	void executeWithMotion(const Mat1i & blockMotion);
+
+	template <typename T>
+	void executeInStrips(const cv::Mat_<T> & motion);
+
+	bool drawsInStrips() const {
+		return m_options.stripHeight > 0 && !m_options.statsOnly;
+	}
+
+	int getStripHeight() const {
+		return std::min(m_options.stripHeight, m_size.height);
+	}
+
+	void checkDeadline();
 	void calculateMaskArea();
-	static Mat3b ConvertInput(const char * label, const cv::Mat & input, const cv::Size & size);
-	static Mat1i ScaleUpMotion(Mat1i & blockMotion, int blockSize, const cv::Size & destSize);
-	void paintSubBlockLine(const cv::Point & start, const cv::Point & step);
+	void executeUnchanged();
+	cv::Rect getTileRect(int xIndex, int yIndex);
+	bool isClean(const cv::Rect & rect);
+	Mat1b getCleanBlocks();
+
+	template <typename T>
+	void clearCleanMotion(cv::Mat_<T> & motion);
+
+	Mat3b convertInput(const char * label, const cv::Mat & input, cv::Mat Context::* buffer);
+
+	template <typename T>
+	cv::Mat_<T> getBuffer(cv::Mat Context::* buffer, const cv::Size & size);
+
+	cv::Mat * getContextBuffer(cv::Mat Context::* buffer);
+	Mat3b & createVisual();
+
+	template <typename T>
+	static void ScaleUpMotion(const Mat1i & blockMotion, int blockSize,
+			cv::Mat_<T> & motion);
+
 	static uchar BgrToGrey(const cv::Vec3b & bgr);
 	static cv::Vec3b BgrToFadedGreyBgr(const cv::Vec3b & bgr);
-	static int GetStrongConsensus(const cv::Mat1i & block);
-	static int GetWeakConsensus(const cv::Mat1i & block);
-	Mat3b visualizeResidual();
-	void annotateMotion();
-	static cv::Point FindMaskCentre(const Mat1b & mask, int totalArea);
+
+	template <typename T>
+	Mat1b visualizeResidual(const cv::Mat_<T> & motion);
+
+	template <typename T>
+	void visualizeResidualRow(int y, const T * motionRow, cv::Vec3b * movedRow,
+			uchar * residualRow, cv::Vec3b * visualRow, bool count = true);
+
+	void highlightResidual(Mat1b & residualMask);
+
+	template <typename T>
+	void annotateMotion(cv::Mat_<T> & motion);
+
+	/**
+	 * The annotation of a motion region, when the visual output is drawn in
+	 * strips
+	 */
+	struct RegionAnnotation {
+		// Whether the region is filled, rather than given an arrow, a label
+		// and contours
+		bool fill;
+		int motion;
+		cv::Rect bounds;
+		cv::Point centre;
+		cv::Scalar colour;
+
+		// The rows on which the annotation may be drawn, from top inclusive
+		// to bottom exclusive
+		int top;
+		int bottom;
+	};
+
+	void annotateStrip(const std::vector<RegionAnnotation> & annotations,
+			const std::vector<int> & regionIndexes, const Mat1i & regionRows,
+			int regionTop, Mat3b & contourStrip, int top);
+
+	void drawInStrip(Mat3b & strip, int top, const cv::Rect & bounds,
+			const std::function<void(Mat3b & canvas, const cv::Point & origin)> & draw);
+
+	void writeStrip(const Mat3b & strip, int top);
+
+	static std::string GetLabel(const cv::Point & centre, int motion,
+			cv::Point & origin, cv::Size & size);
+
 	static void ArrowedLine(Mat3b img, cv::Point pt1, cv::Point pt2, const cv::Scalar& color,
 			   int thickness = 1, int line_type = 8, int shift = 0, double tipLength = 0.1);
 
-	cv::Mat convertIntermediate(const cv::Mat & m);
 	void intermediateOutput(const char* label, const cv::MatExpr & expr);
-	void intermediateOutput(const char* label, const cv::Mat & m);
+	void intermediateOutput(const char* label, const cv::Mat & m, bool copy = false);
+
+	bool hasIntermediateOutput() const {
+		return !m_options.intermediateDir.empty();
+	}
 	
 	Logger::LogStream & info() {
 		return m_logger.log(Logger::INFO);
@@ -66,9 +259,55 @@ private:
 
 	const Options & m_options;
 	Output & m_output;
+
+	// The buffers to reuse, or null if they are allocated for this call only
+	Context * m_context;
+
 	Mat3b m_alice;
 	Mat3b m_bob;
-	Mat1i m_motion;
 	cv::Size m_size;
+
+	// The size of the squares in m_dirtyTiles, a multiple of the block size
+	int m_tileSize;
+
+	// Nonzero for each tile which has a pixel that differs between the inputs
+	Mat1b m_dirtyTiles;
+
 	Logger m_logger;
+
+	// The end of the previous stage, or the start of the diff
+	std::chrono::steady_clock::time_point m_stageStart;
+	double m_stageCpuStart;
+
+	// The CPU time of the worker threads of the current stage
+	double m_workerCpuTime;
+
+	// The total size of the buffers allocated by the diff which are still
+	// held, for Output::peakBufferBytes
+	size_t m_bufferBytes;
+
+	// The size of the copies of the inputs which were extended
+	size_t m_inputCopyBytes;
+
+	// The writer for intermediate images, or null if they are not requested
+	std::unique_ptr<IntermediateWriter> m_intermediateWriter;
+
+	/**
+	 * The contribution of each channel value to the grey value, so that
+	 * conversion to grey does not need any division.
+	 */
+	struct GreyTable {
+		GreyTable();
+
+		uchar channels[3][256];
+	};
+	static const GreyTable s_greyTable;
+
+	// The colours of the motion regions, which are used in turn
+	static const cv::Scalar s_palette[3];
+
+	// Regions smaller than this are too small for contours, so are filled
+	enum {MIN_CONTOUR_AREA = 50};
 };
+
+#endif
@@ -0,0 +1,265 @@
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../UprightDiff.h"
+#include "../JsonFormat.h"
+
+typedef UprightDiff::uchar uchar;
+typedef UprightDiff::Mat3b Mat3b;
+
+/**
+ * A generator of a synthetic screenshot pair. The first image is a page, and
+ * the second image is made from it by the scenario's change.
+ */
+struct Scenario {
+	const char * name;
+	int width;
+	int height;
+	std::function<Mat3b(std::mt19937 & rng, const Mat3b & page)> change;
+};
+
+/**
+ * Make a page which looks like a screenshot: lines of text-like glyphs, with
+ * a few pictures and solid boxes
+ */
+Mat3b makePage(std::mt19937 & rng, int width, int height) {
+	Mat3b page(height, width, cv::Vec3b(255, 255, 255));
+	for (int y = 10; y + 16 < height; ) {
+		if (rng() % 12 == 0) {
+			// A picture with a smooth gradient
+			int boxHeight = std::min(height - y, 60 + (int)(rng() % 200));
+			int boxWidth = 100 + rng() % (width / 2);
+			int x = rng() % (width - boxWidth);
+			uchar base = rng() % 200;
+			for (int by = 0; by < boxHeight; by++) {
+				for (int bx = 0; bx < boxWidth; bx++) {
+					page(y + by, x + bx) = cv::Vec3b(base + by % 50, base + bx % 50, 128);
+				}
+			}
+			y += boxHeight + 10;
+			continue;
+		}
+		if (rng() % 20 == 0) {
+			// A solid box, like a button or a table header
+			int boxHeight = std::min(height - y, 20 + (int)(rng() % 40));
+			page(cv::Rect(10, y, width - 20, boxHeight)) = cv::Vec3b(230, 220, 200);
+			y += boxHeight + 6;
+			continue;
+		}
+		// A line of text
+		int lineHeight = 10 + rng() % 6;
+		int lineEnd = width - 10 - rng() % (width / 3);
+		for (int x = 10; x + 12 < lineEnd; ) {
+			int glyphWidth = 4 + rng() % 7;
+			for (int gy = 0; gy < lineHeight; gy++) {
+				for (int gx = 0; gx < glyphWidth; gx++) {
+					if (rng() % 3 == 0) {
+						uchar value = rng() % 90;
+						page(y + gy, x + gx) = cv::Vec3b(value, value, value);
+					}
+				}
+			}
+			x += glyphWidth + 1 + (rng() % 6 == 0 ? 6 : rng() % 2);
+		}
+		y += lineHeight + 6;
+	}
+	return page;
+}
+
+/**
+ * Copy the page, inserting a band of new content at the given row
+ */
+Mat3b insertBand(std::mt19937 & rng, const Mat3b & page, int at, int bandHeight) {
+	Mat3b result(page.rows + bandHeight, page.cols);
+	page.rowRange(0, at).copyTo(result.rowRange(0, at));
+	makePage(rng, page.cols, bandHeight).copyTo(result.rowRange(at, at + bandHeight));
+	page.rowRange(at, page.rows).copyTo(result.rowRange(at + bandHeight, result.rows));
+	return result;
+}
+
+/**
+ * Fill a rectangle with random noise, like a video still
+ */
+void addNoise(std::mt19937 & rng, Mat3b & image, const cv::Rect & rect) {
+	for (int y = rect.y; y < rect.y + rect.height; y++) {
+		for (int x = rect.x; x < rect.x + rect.width; x++) {
+			image(y, x) = cv::Vec3b(rng() % 256, rng() % 256, rng() % 256);
+		}
+	}
+}
+
+std::vector<Scenario> getScenarios() {
+	std::vector<Scenario> scenarios;
+	scenarios.push_back({"identical", 1280, 4000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			return page.clone();
+		}});
+	scenarios.push_back({"insertion", 1280, 4000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			return insertBand(rng, page, page.rows / 3, 300);
+		}});
+	scenarios.push_back({"deletion", 1280, 4000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			Mat3b result(page.rows - 250, page.cols);
+			int at = page.rows / 2;
+			page.rowRange(0, at).copyTo(result.rowRange(0, at));
+			page.rowRange(at + 250, page.rows).copyTo(result.rowRange(at, result.rows));
+			return result;
+		}});
+	scenarios.push_back({"scrolled-band", 1280, 4000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			// A scrolling box whose content moved up, within an unchanged page
+			Mat3b result = page.clone();
+			cv::Rect frame(200, 1000, 800, 900);
+			int scroll = 137;
+			page(cv::Rect(frame.x, frame.y + scroll, frame.width, frame.height - scroll))
+				.copyTo(result(cv::Rect(frame.x, frame.y, frame.width, frame.height - scroll)));
+			result(cv::Rect(frame.x, frame.y + frame.height - scroll, frame.width, scroll)) =
+				cv::Vec3b(255, 255, 255);
+			return result;
+		}});
+	scenarios.push_back({"noise", 1280, 4000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			// A video still which changed, below an insertion
+			Mat3b result = insertBand(rng, page, 500, 80);
+			addNoise(rng, result, cv::Rect(100, 1500, 1000, 1200));
+			return result;
+		}});
+	scenarios.push_back({"fragments", 1280, 4000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			// Many small pieces of content, each moved by its own offset
+			Mat3b result = page.clone();
+			for (int i = 0; i < 300; i++) {
+				cv::Rect source(rng() % (page.cols - 60), 100 + rng() % (page.rows - 300), 60, 30);
+				int dy = (int)(rng() % 121) - 60;
+				page(source).copyTo(result(source + cv::Point(0, dy)));
+			}
+			return result;
+		}});
+	scenarios.push_back({"tall", 1024, 36000,
+		[](std::mt19937 & rng, const Mat3b & page) {
+			// Taller than the compact motion field allows, with everything
+			// below the top moved
+			return insertBand(rng, page, 400, 120);
+		}});
+	return scenarios;
+}
+
+/**
+ * The fastest time of each stage over the repetitions
+ */
+struct Result {
+	UprightDiff::Output output;
+	double wallTime = 0;
+	std::vector<std::string> stages;
+	std::map<std::string, double> stageTimes;
+};
+
+void addTime(Result & result, const std::string & stage, double time) {
+	auto it = result.stageTimes.find(stage);
+	if (it == result.stageTimes.end()) {
+		result.stages.push_back(stage);
+		result.stageTimes[stage] = time;
+	} else {
+		it->second = std::min(it->second, time);
+	}
+}
+
+Result runScenario(const Scenario & scenario, int repeat, int threads) {
+	std::mt19937 rng(1);
+	Mat3b alice = makePage(rng, scenario.width, scenario.height);
+	Mat3b bob = scenario.change(rng, alice);
+
+	UprightDiff::Options options;
+	options.threads = threads;
+	Result result;
+	for (int i = 0; i < repeat; i++) {
+		UprightDiff::Output output;
+		auto start = std::chrono::steady_clock::now();
+		UprightDiff::Diff(alice, bob, options, output);
+		std::chrono::duration<double, std::milli> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+		for (const auto & timing : output.timings) {
+			addTime(result, timing.stage, timing.wallTime);
+		}
+
+		std::vector<uchar> encoded;
+		start = std::chrono::steady_clock::now();
+		cv::imencode(".png", output.visual, encoded);
+		std::chrono::duration<double, std::milli> encodeTime =
+			std::chrono::steady_clock::now() - start;
+		addTime(result, "encode", encodeTime.count());
+
+		if (i == 0 || elapsed.count() < result.wallTime) {
+			result.wallTime = elapsed.count();
+		}
+		result.output = output;
+	}
+	return result;
+}
+
+std::string formatResult(const Scenario & scenario, const Result & result) {
+	std::ostringstream buf;
+	buf << "{\"name\":" << JsonFormat::FormatString(scenario.name) <<
+		",\"width\":" << result.output.visual.cols <<
+		",\"height\":" << result.output.visual.rows <<
+		"," << JsonFormat::FormatStats(result.output) <<
+		",\"wallTime\":" << result.wallTime <<
+		",\"peakBufferBytes\":" << result.output.peakBufferBytes <<
+		",\"stages\":{";
+	for (size_t i = 0; i < result.stages.size(); i++) {
+		const std::string & stage = result.stages[i];
+		buf << (i ? "," : "") << JsonFormat::FormatString(stage) << ":" <<
+			result.stageTimes.at(stage);
+	}
+	buf << "}}";
+	return buf.str();
+}
+
+/**
+ * Run the benchmark, and write the results as JSON on stdout. The times are
+ * in milliseconds, and are the fastest of the repetitions. The arguments are
+ * the names of the scenarios to run, which default to all of them, and the
+ * options --repeat <n> and --threads <n>.
+ */
+int main(int argc, char** argv) {
+	int repeat = 3;
+	int threads = 1;
+	std::vector<std::string> names;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+			repeat = std::max(1, atoi(argv[++i]));
+		} else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+			threads = std::max(1, atoi(argv[++i]));
+		} else {
+			names.push_back(argv[i]);
+		}
+	}
+
+	std::cout << "{\"repeat\":" << repeat << ",\"threads\":" << threads <<
+		",\"scenarios\":[";
+	bool first = true;
+	for (const Scenario & scenario : getScenarios()) {
+		if (!names.empty() && std::find(names.begin(), names.end(), scenario.name) == names.end()) {
+			continue;
+		}
+		std::cerr << "Running " << scenario.name << "\n";
+		Result result = runScenario(scenario, repeat, threads);
+		std::cout << (first ? "" : ",") << "\n" << formatResult(scenario, result);
+		first = false;
+	}
+	std::cout << "\n]}\n";
+	return 0;
+}
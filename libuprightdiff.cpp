@@ -0,0 +1,152 @@
+#include <opencv2/core/core.hpp>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+#include "UprightDiff.h"
+#include "libuprightdiff.h"
+
+struct uprightdiff_context {
+	UprightDiff::Options options;
+	int deadline = 0;
+	int searchBudget = 0;
+	UprightDiff::Context buffers;
+	UprightDiff::Output output;
+	std::string error;
+};
+
+/**
+ * Set the error message and return the status
+ */
+static uprightdiff_status fail(uprightdiff_context * context,
+		uprightdiff_status status, const std::string & message)
+{
+	context->error = message;
+	while (!context->error.empty() && context->error[context->error.size() - 1] == '\n') {
+		context->error.erase(context->error.size() - 1);
+	}
+	return status;
+}
+
+/**
+ * Wrap an image without copying it, returning false if it is not valid
+ */
+static bool wrapImage(const uprightdiff_image * image, cv::Mat & mat) {
+	if (!image || !image->data || image->width <= 0 || image->height <= 0
+			|| image->stride < (size_t)image->width * 3)
+	{
+		return false;
+	}
+	// The data is only read, so it is safe to cast away const
+	mat = cv::Mat(image->height, image->width, CV_8UC3,
+			const_cast<unsigned char*>(image->data), image->stride);
+	return true;
+}
+
+uprightdiff_context * uprightdiff_create(void) {
+	return new(std::nothrow) uprightdiff_context;
+}
+
+void uprightdiff_destroy(uprightdiff_context * context) {
+	delete context;
+}
+
+uprightdiff_status uprightdiff_set_option(uprightdiff_context * context,
+		uprightdiff_option option, int value)
+{
+	UprightDiff::Options & options = context->options;
+	context->error.clear();
+	int minimum = 1;
+	int * target;
+	switch (option) {
+		case UPRIGHTDIFF_BLOCK_SIZE:
+			target = &options.blockSize;
+			break;
+		case UPRIGHTDIFF_WINDOW_SIZE:
+			target = &options.windowSize;
+			minimum = 0;
+			break;
+		case UPRIGHTDIFF_BRUSH_WIDTH:
+			target = &options.brushWidth;
+			break;
+		case UPRIGHTDIFF_OUTER_HIGHLIGHT_WINDOW:
+			target = &options.outerHighlightWindow;
+			break;
+		case UPRIGHTDIFF_INNER_HIGHLIGHT_WINDOW:
+			target = &options.innerHighlightWindow;
+			break;
+		case UPRIGHTDIFF_THREADS:
+			target = &options.threads;
+			break;
+		case UPRIGHTDIFF_ALIGN_ROWS:
+			options.alignRows = value != 0;
+			return UPRIGHTDIFF_OK;
+		case UPRIGHTDIFF_STATS_ONLY:
+			options.statsOnly = value != 0;
+			return UPRIGHTDIFF_OK;
+		case UPRIGHTDIFF_DEADLINE:
+			target = &context->deadline;
+			minimum = 0;
+			break;
+		case UPRIGHTDIFF_SEARCH_BUDGET:
+			target = &context->searchBudget;
+			minimum = 0;
+			break;
+		default:
+			return fail(context, UPRIGHTDIFF_INVALID_ARGUMENT, "Unknown option");
+	}
+	if (value < minimum) {
+		return fail(context, UPRIGHTDIFF_INVALID_ARGUMENT,
+				"The option value must be at least " + std::to_string(minimum));
+	}
+	*target = value;
+	return UPRIGHTDIFF_OK;
+}
+
+uprightdiff_status uprightdiff_diff(uprightdiff_context * context,
+		const uprightdiff_image * first, const uprightdiff_image * second,
+		uprightdiff_result * result)
+{
+	context->error.clear();
+	cv::Mat alice, bob;
+	if (!wrapImage(first, alice) || !wrapImage(second, bob) || !result) {
+		return fail(context, UPRIGHTDIFF_INVALID_ARGUMENT, "Invalid image or result");
+	}
+
+	UprightDiff::Options options = context->options;
+	options.searchBudget = context->searchBudget;
+	if (context->deadline > 0) {
+		options.deadline = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(context->deadline);
+	}
+	UprightDiff::Output & output = context->output;
+	try {
+		UprightDiff::Diff(alice, bob, options, output, context->buffers);
+	} catch (std::exception & e) {
+		// A failed diff may leave a partial visual, which must not be used
+		output.visual.release();
+		return fail(context, UPRIGHTDIFF_FAILED, e.what());
+	} catch (...) {
+		output.visual.release();
+		return fail(context, UPRIGHTDIFF_FAILED, "Unknown error");
+	}
+
+	result->total_area = output.totalArea;
+	result->modified_area = output.maskArea;
+	result->moved_area = output.movedArea;
+	result->residual_area = output.residualArea;
+	if (output.visual.empty()) {
+		result->visual = uprightdiff_image();
+	} else {
+		result->visual.data = output.visual.data;
+		result->visual.width = output.visual.cols;
+		result->visual.height = output.visual.rows;
+		result->visual.stride = output.visual.step;
+	}
+	result->search_degraded = output.search.degradedBlocks > 0;
+	return UPRIGHTDIFF_OK;
+}
+
+const char * uprightdiff_error(const uprightdiff_context * context) {
+	return context->error.c_str();
+}
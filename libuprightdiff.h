@@ -0,0 +1,114 @@
+#ifndef LIBUPRIGHTDIFF_H
+#define LIBUPRIGHTDIFF_H
+
+#include <stddef.h>
+
+/**
+ * The C interface of libuprightdiff, for embedding the diff in other
+ * languages without running the uprightdiff binary.
+ *
+ * A context holds the options, the buffers reused between diffs, and the
+ * visual output of the last diff. A context may be used by one thread at a
+ * time. Separate contexts may be used concurrently.
+ */
+
+/* The library is built with hidden visibility, so that only these functions
+ * are exported */
+#if defined(__GNUC__)
+#define UPRIGHTDIFF_EXPORT __attribute__((visibility("default")))
+#else
+#define UPRIGHTDIFF_EXPORT
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct uprightdiff_context uprightdiff_context;
+
+/**
+ * An image with 8-bit BGR pixels, stored as rows of width * 3 bytes, with
+ * stride bytes from the start of one row to the start of the next.
+ */
+typedef struct uprightdiff_image {
+	const unsigned char * data;
+	int width;
+	int height;
+	size_t stride;
+} uprightdiff_image;
+
+/**
+ * The result of a diff. The visual buffer belongs to the context, and is
+ * valid until the next diff with the context, or until it is destroyed. It is
+ * null if only the statistics were requested.
+ */
+typedef struct uprightdiff_result {
+	int total_area;
+	int modified_area;
+	int moved_area;
+	int residual_area;
+	uprightdiff_image visual;
+	/* Nonzero if the search budget was exceeded */
+	int search_degraded;
+} uprightdiff_result;
+
+typedef enum uprightdiff_status {
+	UPRIGHTDIFF_OK = 0,
+	UPRIGHTDIFF_INVALID_ARGUMENT = 1,
+	UPRIGHTDIFF_FAILED = 2
+} uprightdiff_status;
+
+/**
+ * The options, with the same meaning and defaults as the command line
+ * options of the same name
+ */
+typedef enum uprightdiff_option {
+	UPRIGHTDIFF_BLOCK_SIZE = 1,
+	UPRIGHTDIFF_WINDOW_SIZE = 2,
+	UPRIGHTDIFF_BRUSH_WIDTH = 3,
+	UPRIGHTDIFF_OUTER_HIGHLIGHT_WINDOW = 4,
+	UPRIGHTDIFF_INNER_HIGHLIGHT_WINDOW = 5,
+	UPRIGHTDIFF_THREADS = 6,
+	UPRIGHTDIFF_ALIGN_ROWS = 7,
+	/* Nonzero to only calculate the statistics */
+	UPRIGHTDIFF_STATS_ONLY = 8,
+	/* The time limit for each diff in milliseconds, or zero for none */
+	UPRIGHTDIFF_DEADLINE = 9,
+	/* The number of block comparisons after which the motion search degrades,
+	 * or zero for no limit */
+	UPRIGHTDIFF_SEARCH_BUDGET = 10
+} uprightdiff_option;
+
+/**
+ * Create a context with the default options. Returns null if there is not
+ * enough memory.
+ */
+UPRIGHTDIFF_EXPORT uprightdiff_context * uprightdiff_create(void);
+
+/**
+ * Destroy a context and free its buffers
+ */
+UPRIGHTDIFF_EXPORT void uprightdiff_destroy(uprightdiff_context * context);
+
+UPRIGHTDIFF_EXPORT uprightdiff_status uprightdiff_set_option(uprightdiff_context * context,
+		uprightdiff_option option, int value);
+
+/**
+ * Diff two images. The image data is read in place, without being copied.
+ * If the images have different sizes, they are extended to the same size.
+ */
+UPRIGHTDIFF_EXPORT uprightdiff_status uprightdiff_diff(uprightdiff_context * context,
+		const uprightdiff_image * first, const uprightdiff_image * second,
+		uprightdiff_result * result);
+
+/**
+ * Get a message describing the last error, or an empty string if the last
+ * call succeeded. The message is valid until the next call with the context.
+ */
+UPRIGHTDIFF_EXPORT const char * uprightdiff_error(const uprightdiff_context * context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,9 +1,19 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
 #include <iostream>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 #include <boost/program_options.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
 #include "UprightDiff.h"
+#include "ImageWriter.h"
+#include "DiffServer.h"
+#include "JsonFormat.h"
 
 namespace po = boost::program_options;
 
@@ -17,9 +27,36 @@ struct MainOptions {
 	std::string aliceName;
 	std::string bobName;
 	std::string destName;
+	std::string batchName;
+	std::string socketPath;
+	int jobs = 1;
+	int deadline = 0;
+	int idleTimeout = 10000;
+	ImageWriter::Options writerOptions;
 };
+
+struct BatchItem {
+	std::string aliceName;
+	std::string bobName;
+	std::string destName;
+
+	// If the manifest line was malformed, the reason, in which case the
+	// paths are empty
+	std::string error;
+};
+
 bool processCommandLine(int argc, char** argv,
 		MainOptions & mainOptions, UprightDiff::Options & diffOptions);
+void diffFiles(const std::string & aliceName, const std::string & bobName,
+		const std::string & destName, const MainOptions & mainOptions,
+		UprightDiff::Options diffOptions, UprightDiff::Output & output,
+		UprightDiff::Context * context = nullptr);
+int runServer(const MainOptions & mainOptions, const UprightDiff::Options & diffOptions);
+int runBatch(const MainOptions & mainOptions, const UprightDiff::Options & diffOptions);
+bool readManifest(const std::string & name, std::vector<BatchItem> & items);
+std::string processBatchItem(const BatchItem & item, const MainOptions & mainOptions,
+		const UprightDiff::Options & diffOptions, UprightDiff::Context & context,
+		UprightDiff::Output & output, bool & success);
 
 int main(int argc, char** argv) {
 	MainOptions mainOptions;
@@ -34,17 +71,21 @@ int main(int argc, char** argv) {
 		return 1;
 	}
 
-	cv::Mat alice = cv::imread(mainOptions.aliceName);
-	cv::Mat bob = cv::imread(mainOptions.bobName);
-	UprightDiff::Output output;
+	if (!mainOptions.batchName.empty()) {
+		return runBatch(mainOptions, diffOptions);
+	}
+	if (!mainOptions.socketPath.empty()) {
+		return runServer(mainOptions, diffOptions);
+	}
 
+	UprightDiff::Output output;
 	try {
-		UprightDiff::Diff(alice, bob, diffOptions, output);
-	} catch (std::runtime_error & e) {
+		diffFiles(mainOptions.aliceName, mainOptions.bobName, mainOptions.destName,
+				mainOptions, diffOptions, output);
+	} catch (std::exception & e) {
 		std::cerr << "Error: " << e.what() << "\n";
 		return 1;
 	}
-	cv::imwrite(mainOptions.destName, output.visual);
 
 	if (mainOptions.format == MainOptions::TEXT) {
 		std::cout << "Total area: " << output.totalArea << " pixels\n";
@@ -52,12 +93,199 @@ int main(int argc, char** argv) {
 		std::cout << "Moved area: " << output.movedArea << " pixels\n";
 		std::cout << "Residual area: " << output.residualArea << " pixels\n";
 	} else if (mainOptions.format == MainOptions::JSON) {
-		std::cout <<
-			"{\"totalArea\":" << output.totalArea << "," <<
-			"\"modifiedArea\":" << output.maskArea << "," <<
-			"\"movedArea\":" << output.movedArea << "," <<
-			"\"residualArea\":" << output.residualArea << "}\n";
+		std::cout << "{" << JsonFormat::FormatStats(output) << "," <<
+			JsonFormat::FormatTimings(output) << "}\n";
+	}
+	return 0;
+}
+
+/**
+ * Read two images, diff them and write the visual output. If destName is
+ * empty, only the statistics are calculated. If the deadline is nonzero, the
+ * diff fails if it takes longer than that many milliseconds. If a context is
+ * given, its buffers are reused.
+ */
+void diffFiles(const std::string & aliceName, const std::string & bobName,
+		const std::string & destName, const MainOptions & mainOptions,
+		UprightDiff::Options diffOptions, UprightDiff::Output & output,
+		UprightDiff::Context * context)
+{
+	if (mainOptions.deadline > 0) {
+		diffOptions.deadline = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(mainOptions.deadline);
+	}
+	if (destName.empty()) {
+		diffOptions.statsOnly = true;
+	}
+	Logger logger(std::cerr, diffOptions.logLevel, diffOptions.logTimestamp);
+	ImageWriter writer(mainOptions.writerOptions);
+	if (diffOptions.stripHeight > 0) {
+		// If the diff fails, the writer removes the partial output
+		diffOptions.stripWriter = [&](const cv::Mat & strip, int y, const cv::Size & size) {
+			writer.writeStrip(destName, strip, y, size, logger);
+		};
+	}
+	cv::Mat alice = cv::imread(aliceName);
+	cv::Mat bob = cv::imread(bobName);
+	if (context) {
+		UprightDiff::Diff(alice, bob, diffOptions, output, *context);
+	} else {
+		UprightDiff::Diff(alice, bob, diffOptions, output);
+	}
+	if (!destName.empty() && diffOptions.stripHeight == 0) {
+		writer.write(destName, output.visual, logger);
+	}
+}
+
+/**
+ * Diff each pair in the manifest, using a pool of worker threads, and write
+ * the statistics for each pair as a line of JSON, in the order of the
+ * manifest. A failed pair is reported with an error message, and does not
+ * stop the batch.
+ */
+int runBatch(const MainOptions & mainOptions, const UprightDiff::Options & diffOptions) {
+	std::vector<BatchItem> items;
+	if (!readManifest(mainOptions.batchName, items)) {
+		return 1;
+	}
+
+	std::mutex mutex;
+	size_t nextItem = 0;
+	size_t nextResult = 0;
+	std::vector<std::string> results(items.size());
+	std::vector<bool> done(items.size(), false);
+	bool failed = false;
+
+	auto work = [&]() {
+		// Each worker reuses its buffers for the pairs it diffs
+		UprightDiff::Context context;
+		UprightDiff::Output output;
+		for (;;) {
+			size_t i;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (nextItem >= items.size()) {
+					return;
+				}
+				i = nextItem++;
+			}
+			bool success;
+			std::string result = processBatchItem(items[i], mainOptions, diffOptions,
+					context, output, success);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			results[i] = result;
+			done[i] = true;
+			if (!success) {
+				failed = true;
+			}
+			for (; nextResult < items.size() && done[nextResult]; nextResult++) {
+				std::cout << results[nextResult] << "\n";
+				results[nextResult].clear();
+			}
+			std::cout.flush();
+		}
+	};
+
+	int jobs = std::max(1, std::min(mainOptions.jobs, (int)items.size()));
+	std::vector<std::thread> workers;
+	for (int i = 1; i < jobs; i++) {
+		workers.emplace_back(work);
+	}
+	work();
+	for (auto & worker : workers) {
+		worker.join();
+	}
+	return failed ? 1 : 0;
+}
+
+/**
+ * Read a manifest with one pair per line, as three tab-separated paths. The
+ * output path may be empty. Empty lines and lines starting with "#" are
+ * ignored. A malformed line gives an item with an error, so that it is
+ * reported in order with the other pairs.
+ */
+bool readManifest(const std::string & name, std::vector<BatchItem> & items) {
+	std::ifstream file(name);
+	if (!file) {
+		std::cerr << "Error: unable to open the manifest \"" << name << "\"\n";
+		return false;
+	}
+	std::string line;
+	for (int lineNumber = 1; std::getline(file, line); lineNumber++) {
+		if (!line.empty() && line[line.size() - 1] == '\r') {
+			line.erase(line.size() - 1);
+		}
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::vector<std::string> fields;
+		std::istringstream lineStream(line);
+		std::string field;
+		while (std::getline(lineStream, field, '\t')) {
+			fields.push_back(field);
+		}
+		if (line[line.size() - 1] == '\t') {
+			fields.push_back("");
+		}
+		if (fields.size() != 3) {
+			BatchItem item;
+			item.error = name + " line " + std::to_string(lineNumber) +
+				": expected three tab-separated paths";
+			items.push_back(item);
+			continue;
+		}
+		items.push_back(BatchItem{fields[0], fields[1], fields[2], ""});
 	}
+	return true;
+}
+
+std::string processBatchItem(const BatchItem & item, const MainOptions & mainOptions,
+		const UprightDiff::Options & diffOptions, UprightDiff::Context & context,
+		UprightDiff::Output & output, bool & success)
+{
+	if (!item.error.empty()) {
+		success = false;
+		return "{\"error\":" + JsonFormat::FormatString(item.error) + "}";
+	}
+	std::string result = "{\"input1\":" + JsonFormat::FormatString(item.aliceName) +
+		",\"input2\":" + JsonFormat::FormatString(item.bobName) +
+		",\"output\":" + JsonFormat::FormatString(item.destName) + ",";
+	try {
+		diffFiles(item.aliceName, item.bobName, item.destName, mainOptions,
+				diffOptions, output, &context);
+		result += JsonFormat::FormatStats(output) + "," +
+			JsonFormat::FormatTimings(output);
+		success = true;
+	} catch (std::exception & e) {
+		std::string message = e.what();
+		while (!message.empty() && message[message.size() - 1] == '\n') {
+			message.erase(message.size() - 1);
+		}
+		result += "\"error\":" + JsonFormat::FormatString(message);
+		success = false;
+	}
+	return result + "}";
+}
+
+/**
+ * Serve diff requests on a Unix domain socket until there is an error
+ */
+int runServer(const MainOptions & mainOptions, const UprightDiff::Options & diffOptions) {
+	DiffServer::Options serverOptions;
+	serverOptions.socketPath = mainOptions.socketPath;
+	serverOptions.jobs = mainOptions.jobs;
+	serverOptions.deadline = mainOptions.deadline;
+	serverOptions.idleTimeout = mainOptions.idleTimeout;
+	serverOptions.writerOptions = mainOptions.writerOptions;
+	serverOptions.diffOptions = diffOptions;
+	try {
+		DiffServer server(serverOptions);
+		server.run();
+	} catch (std::runtime_error & e) {
+		std::cerr << "Error: " << e.what() << "\n";
+	}
+	return 1;
 }
 
 bool processCommandLine(int argc, char** argv,
@@ -65,13 +293,16 @@ bool processCommandLine(int argc, char** argv,
 {
 	po::options_description visible;
 	std::string format;
+	std::string outputFormat;
+	std::string pngStrategy;
 	visible.add_options()
 		("help",
 		 	"Show help message and exit")
 		("block-size", po::value<int>(&diffOptions.blockSize),
 			"Block size for initial search (default 16)")
 		("window-size", po::value<int>(&diffOptions.windowSize),
-			"Initial range for vertical motion detection (default 200)")
+			"Initial range for vertical motion detection. This may be as large as the "
+			"image height, since the search cost does not depend on it. (default 200)")
 		("brush-width", po::value<int>(&diffOptions.brushWidth),
 		 	"Brush width when heuristically expanding blocks. "
 			"A higher value gives smoother motion regions. "
@@ -82,6 +313,19 @@ bool processCommandLine(int argc, char** argv,
 		("inner-hl-window", po::value<int>(&diffOptions.innerHighlightWindow),
 		 	"The size of the inner square used for detecting isolated small features to highlight. "
 			"This size defines what we mean by \"small\". It should be an odd number. (default 5)")
+		("threads", po::value<int>(&diffOptions.threads),
+			"The number of threads to use for motion search (default 1)")
+		("no-row-align",
+			"Search every block for motion, instead of first aligning full-width rows.")
+		("search-budget", po::value<long long>(&diffOptions.searchBudget),
+			"The maximum number of block comparisons in the motion search. After this, "
+			"only the predicted motion of each block is tried, which bounds the time "
+			"taken by inputs such as noise. (default no limit)")
+		("strip-height", po::value<int>(&diffOptions.stripHeight),
+			"Draw and write the output image in strips of this many rows. The output is "
+			"the same, but the memory used to draw it depends on the image width and not "
+			"its height. The output must be PNG. (default 0, which draws the whole image "
+			"at once)")
 		("intermediate-dir", po::value<std::string>(&diffOptions.intermediateDir),
 		 	"A directory where intermediate images should be placed. "
 			"This is our equivalent of debug or trace output.")
@@ -91,6 +335,32 @@ bool processCommandLine(int argc, char** argv,
 		 	"The output format for statistics, may be text (the default), json or none.")
 		("log-timestamp,t", po::bool_switch(&diffOptions.logTimestamp),
 		 	"Annotate progress info with elapsed time.")
+		("output-format", po::value<std::string>(&outputFormat),
+			"The format of the output image, may be auto (the default, which uses the "
+			"file extension), png, webp (lossless), ppm or bmp. PPM and BMP are "
+			"uncompressed, so they are the fastest to write.")
+		("png-compression", po::value<int>(&mainOptions.writerOptions.pngCompression),
+			"The PNG compression level from 0 to 9. Lower levels are faster but "
+			"give larger files. (default: the OpenCV default)")
+		("png-strategy", po::value<std::string>(&pngStrategy),
+			"The PNG compression strategy, may be default, filtered, huffman, rle or "
+			"fixed. The huffman and rle strategies are faster.")
+		("batch", po::value<std::string>(&mainOptions.batchName),
+			"Diff every pair listed in the given manifest file, instead of a single pair. "
+			"Each line of the manifest has three tab-separated paths: two inputs and an output, "
+			"which may be empty. "
+			"The statistics for each pair are written as a line of JSON.")
+		("jobs,j", po::value<int>(&mainOptions.jobs),
+			"The number of pairs to diff in parallel in batch or server mode (default 1)")
+		("serve", po::value<std::string>(&mainOptions.socketPath),
+			"Listen on the given Unix domain socket path, and diff the images named or "
+			"sent in each request.")
+		("deadline", po::value<int>(&mainOptions.deadline),
+			"The maximum time in milliseconds for each diff, after which it fails "
+			"(default no limit)")
+		("idle-timeout", po::value<int>(&mainOptions.idleTimeout),
+			"In server mode, the time in milliseconds after which a connection with no "
+			"input is closed, or zero for no limit (default 10000)")
 		;
 
 	po::options_description invisible;
@@ -119,16 +389,88 @@ bool processCommandLine(int argc, char** argv,
 
 	if (vm.count("help")) {
 		std::cout << "Usage: " << (argc >= 1 ? argv[0] : "uprightdiff" )
-			<< " [options] <input-1> <input-2> <output>\n"
+			<< " [options] <input-1> <input-2> [<output>]\n"
+			<< "       " << (argc >= 1 ? argv[0] : "uprightdiff" )
+			<< " [options] --batch <manifest>\n"
+			<< "       " << (argc >= 1 ? argv[0] : "uprightdiff" )
+			<< " [options] --serve <socket>\n"
 			<< "Accepted options are:\n"
 			<< visible;
 		return false;
 	}
+	if (vm.count("no-row-align")) {
+		diffOptions.alignRows = false;
+	}
 	if (vm.count("verbose")) {
 		diffOptions.logLevel = Logger::INFO;
 	}
-	if (!(vm.count("alice") && vm.count("bob") && vm.count("dest"))) {
-		std::cerr << "Error: two input filenames and an output filename must be specified.\n";
+	if (vm.count("batch") && vm.count("serve")) {
+		std::cerr << "Error: --batch and --serve may not be used together\n";
+		return false;
+	}
+	if (vm.count("batch") || vm.count("serve")) {
+		if (vm.count("alice")) {
+			std::cerr << "Error: filenames may not be given with --batch or --serve\n";
+			return false;
+		}
+		// Every pair would write its intermediate images to the same files
+		if (vm.count("intermediate-dir")) {
+			std::cerr << "Error: --intermediate-dir may not be used with --batch or --serve\n";
+			return false;
+		}
+	} else if (!(vm.count("alice") && vm.count("bob"))) {
+		std::cerr << "Error: two input filenames must be specified.\n";
+		return false;
+	}
+	if (mainOptions.jobs < 1) {
+		std::cerr << "Error: --jobs must be at least 1\n";
+		return false;
+	}
+	if (mainOptions.deadline < 0) {
+		std::cerr << "Error: --deadline must not be negative\n";
+		return false;
+	}
+	if (mainOptions.idleTimeout < 0) {
+		std::cerr << "Error: --idle-timeout must not be negative\n";
+		return false;
+	}
+	if (diffOptions.windowSize < 0) {
+		std::cerr << "Error: --window-size must not be negative\n";
+		return false;
+	}
+	if (diffOptions.searchBudget < 0) {
+		std::cerr << "Error: --search-budget must not be negative\n";
+		return false;
+	}
+	if (diffOptions.stripHeight < 0) {
+		std::cerr << "Error: --strip-height must not be negative\n";
+		return false;
+	}
+	if (diffOptions.stripHeight > 0 && vm.count("intermediate-dir")) {
+		std::cerr << "Error: --strip-height may not be used with --intermediate-dir\n";
+		return false;
+	}
+	if (diffOptions.threads < 1) {
+		std::cerr << "Error: --threads must be at least 1\n";
+		return false;
+	}
+	if (vm.count("output-format")
+		&& !ImageWriter::ParseFormat(outputFormat, mainOptions.writerOptions.format))
+	{
+		std::cerr << "Error: --output-format must be auto, png, webp, ppm or bmp\n";
+		return false;
+	}
+	if (vm.count("png-compression")
+		&& (mainOptions.writerOptions.pngCompression < 0
+			|| mainOptions.writerOptions.pngCompression > 9))
+	{
+		std::cerr << "Error: --png-compression must be from 0 to 9\n";
+		return false;
+	}
+	if (vm.count("png-strategy")
+		&& !ImageWriter::ParsePngStrategy(pngStrategy, mainOptions.writerOptions.pngStrategy))
+	{
+		std::cerr << "Error: --png-strategy must be default, filtered, huffman, rle or fixed\n";
 		return false;
 	}
 	if (vm.count("format")) {
@@ -0,0 +1,61 @@
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+#include "../BlockComparator.h"
+
+typedef BlockComparator::uchar uchar;
+bool good = true;
+
+void compare(int blockSize, bool expected, const uchar * p1, size_t step1,
+		const uchar * p2, size_t step2, int differentIndex)
+{
+	BlockComparator::Function equal = BlockComparator::Get(blockSize);
+	bool result = equal(p1, step1, p2, step2, blockSize);
+	if (result != expected) {
+		std::cout << "Error: block size " << blockSize << ": difference at byte " <<
+			differentIndex << " gave " << (result ? "equal" : "not equal") << "\n";
+		good = false;
+	}
+}
+
+/**
+ * Compare blocks which are identical except for a single byte, at every
+ * position in the block, with distinct strides so that any read past the end
+ * of a row will see different padding.
+ */
+void testBlockSize(int blockSize) {
+	size_t rowSize = blockSize * 3;
+	size_t step1 = rowSize + 5;
+	size_t step2 = rowSize + 11;
+	std::vector<uchar> buf1(step1 * blockSize), buf2(step2 * blockSize);
+	for (size_t i = 0; i < buf1.size(); i++) {
+		buf1[i] = std::rand();
+	}
+	for (size_t i = 0; i < buf2.size(); i++) {
+		buf2[i] = std::rand();
+	}
+	for (int y = 0; y < blockSize; y++) {
+		for (size_t x = 0; x < rowSize; x++) {
+			buf2[y * step2 + x] = buf1[y * step1 + x];
+		}
+	}
+
+	compare(blockSize, true, buf1.data(), step1, buf2.data(), step2, -1);
+	for (int y = 0; y < blockSize; y++) {
+		for (size_t x = 0; x < rowSize; x++) {
+			uchar & b = buf2[y * step2 + x];
+			b ^= 0x80;
+			compare(blockSize, false, buf1.data(), step1, buf2.data(), step2, y * rowSize + x);
+			b ^= 0x80;
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	for (int blockSize = 1; blockSize <= 40; blockSize++) {
+		testBlockSize(blockSize);
+	}
+	testBlockSize(64);
+
+	return good ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+#include <iostream>
+#include <random>
+#include <opencv2/core/core.hpp>
+#include "../UprightDiff.h"
+#include "../libuprightdiff.h"
+
+typedef UprightDiff::Mat3b Mat3b;
+bool good = true;
+
+/**
+ * Make a page of random text-like blocks on a white background
+ */
+Mat3b makePage(std::mt19937 & rng, int width, int height) {
+	Mat3b page(height, width, cv::Vec3b(255, 255, 255));
+	for (int y = 8; y + 12 < height; y += 20) {
+		for (int x = 4; x + 6 < width; x += 8) {
+			if (rng() % 4) {
+				unsigned char value = rng() % 128;
+				page(cv::Rect(x, y, 6, 12)) = cv::Vec3b(value, value, value);
+			}
+		}
+	}
+	return page;
+}
+
+/**
+ * Copy an image into a buffer with padding after each row, and describe it
+ */
+uprightdiff_image makeImage(const Mat3b & mat, std::vector<unsigned char> & buffer) {
+	size_t stride = mat.cols * 3 + 13;
+	buffer.assign(stride * mat.rows, 0xaa);
+	for (int y = 0; y < mat.rows; y++) {
+		std::copy(mat[y], mat[y] + mat.cols, (cv::Vec3b*)&buffer[y * stride]);
+	}
+	return uprightdiff_image{buffer.data(), mat.cols, mat.rows, stride};
+}
+
+void testDiff(uprightdiff_context * context, int seed, int insertion, bool statsOnly) {
+	std::mt19937 rng(seed);
+	// The second image has a band inserted, and may be narrower
+	Mat3b alice = makePage(rng, 200, 300 + seed);
+	Mat3b bob(300, 200 - seed);
+	for (int y = 0; y < bob.rows; y++) {
+		for (int x = 0; x < bob.cols; x++) {
+			if (y < 150) {
+				bob(y, x) = alice(y, x);
+			} else if (y < 150 + insertion) {
+				bob(y, x) = cv::Vec3b(0, 0, 255);
+			} else {
+				bob(y, x) = alice(y - insertion, x);
+			}
+		}
+	}
+
+	UprightDiff::Options options;
+	options.statsOnly = statsOnly;
+	UprightDiff::Output expected;
+	UprightDiff::Diff(alice, bob, options, expected);
+
+	std::vector<unsigned char> aliceBuffer, bobBuffer;
+	uprightdiff_image first = makeImage(alice, aliceBuffer);
+	uprightdiff_image second = makeImage(bob, bobBuffer);
+	uprightdiff_result result;
+	uprightdiff_set_option(context, UPRIGHTDIFF_STATS_ONLY, statsOnly);
+	if (uprightdiff_diff(context, &first, &second, &result) != UPRIGHTDIFF_OK) {
+		std::cout << "Error: seed " << seed << ": " << uprightdiff_error(context) << "\n";
+		good = false;
+		return;
+	}
+
+	bool same = result.total_area == expected.totalArea
+		&& result.modified_area == expected.maskArea
+		&& result.moved_area == expected.movedArea
+		&& result.residual_area == expected.residualArea;
+	if (statsOnly) {
+		same = same && result.visual.data == nullptr;
+	} else if (result.visual.width != expected.visual.cols
+		|| result.visual.height != expected.visual.rows)
+	{
+		same = false;
+	} else {
+		for (int y = 0; y < expected.visual.rows && same; y++) {
+			const cv::Vec3b * row = (const cv::Vec3b*)(result.visual.data + y * result.visual.stride);
+			same = std::equal(row, row + expected.visual.cols, expected.visual[y]);
+		}
+	}
+	if (!same) {
+		std::cout << "Error: seed " << seed << (statsOnly ? " (stats only)" : "") <<
+			": the result differs from UprightDiff::Diff()\n";
+		good = false;
+	}
+}
+
+void testInvalid(uprightdiff_context * context) {
+	unsigned char pixels[12] = {};
+	uprightdiff_image valid = {pixels, 2, 2, 6};
+	uprightdiff_image shortStride = {pixels, 2, 2, 5};
+	uprightdiff_result result;
+	if (uprightdiff_diff(context, &valid, &shortStride, &result) != UPRIGHTDIFF_INVALID_ARGUMENT
+		|| uprightdiff_error(context)[0] == '\0')
+	{
+		std::cout << "Error: a short stride was accepted\n";
+		good = false;
+	}
+	if (uprightdiff_set_option(context, UPRIGHTDIFF_THREADS, 0) != UPRIGHTDIFF_INVALID_ARGUMENT) {
+		std::cout << "Error: zero threads was accepted\n";
+		good = false;
+	}
+	if (uprightdiff_diff(context, &valid, &valid, &result) != UPRIGHTDIFF_OK
+		|| uprightdiff_error(context)[0] != '\0'
+		|| result.modified_area != 0)
+	{
+		std::cout << "Error: the error was not cleared\n";
+		good = false;
+	}
+}
+
+/**
+ * With a tiny search budget, the search degrades, and this is reported
+ */
+void testBudget(uprightdiff_context * context) {
+	std::mt19937 rng(10);
+	Mat3b alice = makePage(rng, 200, 300);
+	Mat3b bob(300, 200, cv::Vec3b(255, 255, 255));
+	alice.rowRange(0, 290).copyTo(bob.rowRange(10, 300));
+
+	std::vector<unsigned char> aliceBuffer, bobBuffer;
+	uprightdiff_image first = makeImage(alice, aliceBuffer);
+	uprightdiff_image second = makeImage(bob, bobBuffer);
+	uprightdiff_result result;
+	uprightdiff_set_option(context, UPRIGHTDIFF_ALIGN_ROWS, 0);
+	for (int budget : {0, 1}) {
+		uprightdiff_set_option(context, UPRIGHTDIFF_SEARCH_BUDGET, budget);
+		if (uprightdiff_diff(context, &first, &second, &result) != UPRIGHTDIFF_OK
+			|| result.search_degraded != (budget > 0))
+		{
+			std::cout << "Error: budget " << budget << " was not reported\n";
+			good = false;
+		}
+	}
+	uprightdiff_set_option(context, UPRIGHTDIFF_SEARCH_BUDGET, 0);
+	uprightdiff_set_option(context, UPRIGHTDIFF_ALIGN_ROWS, 1);
+}
+
+int main(int argc, char** argv) {
+	uprightdiff_context * context = uprightdiff_create();
+	// Diff several sizes with the same context, so that its buffers are
+	// reused and resized
+	for (int seed = 0; seed < 6; seed++) {
+		testDiff(context, seed, 10 + seed * 7, false);
+		testDiff(context, seed, 10 + seed * 7, true);
+	}
+	testInvalid(context);
+	testBudget(context);
+	uprightdiff_destroy(context);
+	return good ? 0 : 1;
+}
@@ -0,0 +1,167 @@
+#include <iostream>
+#include <random>
+#include <opencv2/core/core.hpp>
+#include "../MotionValue.h"
+#include "../MotionRegions.h"
+
+typedef MotionRegions::Mat1i Mat1i;
+typedef MotionRegions::Mat1b Mat1b;
+typedef MotionRegions::Region Region;
+enum {NOT_FOUND = MotionValue<int>::NOT_FOUND};
+bool good = true;
+
+/**
+ * The reference implementation, which fills each region from its first
+ * pixel in raster order
+ */
+std::vector<Region> referenceRegions(const Mat1i & motion, std::vector<Mat1b> & masks) {
+	std::vector<Region> regions;
+	Mat1b done(motion.size(), (unsigned char)0);
+	for (int y = 0; y < motion.rows; y++) {
+		for (int x = 0; x < motion.cols; x++) {
+			int value = motion(y, x);
+			if (done(y, x) || value == 0 || value == NOT_FOUND) {
+				continue;
+			}
+			Region region = {value, 0, 0, 0, cv::Rect(x, y, 1, 1)};
+			Mat1b mask(motion.size(), (unsigned char)0);
+			std::vector<cv::Point> stack(1, cv::Point(x, y));
+			done(y, x) = 1;
+			while (!stack.empty()) {
+				cv::Point p = stack.back();
+				stack.pop_back();
+				mask(p) = 255;
+				region.area++;
+				region.sumX += p.x;
+				region.sumY += p.y;
+				region.bounds |= cv::Rect(p.x, p.y, 1, 1);
+				cv::Point neighbours[] = {
+					p + cv::Point(1, 0), p + cv::Point(-1, 0),
+					p + cv::Point(0, 1), p + cv::Point(0, -1)
+				};
+				for (const cv::Point & n : neighbours) {
+					if (n.x >= 0 && n.y >= 0 && n.x < motion.cols && n.y < motion.rows
+						&& !done(n) && motion(n) == value)
+					{
+						done(n) = 1;
+						stack.push_back(n);
+					}
+				}
+			}
+			regions.push_back(region);
+			masks.push_back(mask(region.bounds).clone());
+		}
+	}
+	return regions;
+}
+
+/**
+ * Get the mask of each region from the labels
+ */
+std::vector<Mat1b> getMasks(const MotionRegions & regions) {
+	std::vector<Mat1b> masks;
+	for (size_t i = 0; i < regions.regions().size(); i++) {
+		masks.push_back(regions.getMask(i));
+	}
+	return masks;
+}
+
+/**
+ * Get the mask of each region by scanning the rows again
+ */
+template <typename T>
+std::vector<Mat1b> scanMasks(const MotionRegions & regions, const cv::Mat_<T> & motion) {
+	std::vector<Mat1b> masks;
+	for (const Region & region : regions.regions()) {
+		masks.push_back(Mat1b(region.bounds.size(), (unsigned char)0));
+	}
+	MotionRegions::RowScanner<T> scanner(regions, motion);
+	std::vector<int> regionRow(motion.cols);
+	for (int y = 0; y < motion.rows; y++) {
+		scanner.next(regionRow.data());
+		for (int x = 0; x < motion.cols; x++) {
+			int index = regionRow[x];
+			if (index >= 0 && index < (int)masks.size()
+				&& regions.regions()[index].bounds.contains(cv::Point(x, y)))
+			{
+				const cv::Point & tl = regions.regions()[index].bounds.tl();
+				masks[index](y - tl.y, x - tl.x) = 255;
+			} else if (index != -1) {
+				// Outside the bounds of its region, which cannot be right
+				masks.clear();
+				return masks;
+			}
+		}
+	}
+	return masks;
+}
+
+void compareRegions(const char * typeName, int seed, const MotionRegions & actual,
+		const std::vector<Mat1b> & actualMasks,
+		const std::vector<Region> & expected, const std::vector<Mat1b> & expectedMasks)
+{
+	bool same = expected.size() == actual.regions().size()
+		&& expected.size() == actualMasks.size();
+	for (size_t i = 0; same && i < expected.size(); i++) {
+		const Region & e = expected[i];
+		const Region & a = actual.regions()[i];
+		same = e.motion == a.motion && e.area == a.area && e.sumX == a.sumX
+			&& e.sumY == a.sumY && e.bounds == a.bounds;
+		const Mat1b & mask = actualMasks[i];
+		for (int y = 0; same && y < mask.rows; y++) {
+			for (int x = 0; x < mask.cols; x++) {
+				if (mask(y, x) != expectedMasks[i](y, x)) {
+					same = false;
+					break;
+				}
+			}
+		}
+	}
+	if (!same) {
+		std::cout << "Error: " << typeName << " seed " << seed << ": got " <<
+			actual.regions().size() << " regions, expected " <<
+			expected.size() << "\n";
+		good = false;
+	}
+}
+
+void testRandom(int seed) {
+	std::mt19937 rng(seed);
+	int width = 1 + rng() % 80;
+	int height = 1 + rng() % 80;
+	int valueCount = 1 + rng() % 4;
+	Mat1i motion(height, width);
+	cv::Mat_<int16_t> compactMotion(height, width);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int value = rng() % (valueCount + 1);
+			bool notFound = value == valueCount;
+			motion(y, x) = notFound ? (int)NOT_FOUND : value;
+			compactMotion(y, x) = notFound ? MotionValue<int16_t>::NOT_FOUND : value;
+		}
+	}
+
+	std::vector<Mat1b> expectedMasks;
+	std::vector<Region> expected = referenceRegions(motion, expectedMasks);
+	MotionRegions compactRegions(compactMotion);
+	compareRegions("int16_t", seed, compactRegions, getMasks(compactRegions),
+			expected, expectedMasks);
+
+	MotionRegions scanned = MotionRegions::FindWithoutLabels(compactMotion);
+	compareRegions("scanned int16_t", seed, scanned, scanMasks(scanned, compactMotion),
+			expected, expectedMasks);
+	scanned = MotionRegions::FindWithoutLabels(motion);
+	compareRegions("scanned int", seed, scanned, scanMasks(scanned, motion),
+			expected, expectedMasks);
+
+	// This overwrites the motion field with the labels, so it is last
+	MotionRegions regions(motion);
+	compareRegions("int", seed, regions, getMasks(regions), expected, expectedMasks);
+}
+
+int main(int argc, char** argv) {
+	for (int seed = 0; seed < 500; seed++) {
+		testRandom(seed);
+	}
+	return good ? 0 : 1;
+}
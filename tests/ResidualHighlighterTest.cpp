@@ -0,0 +1,88 @@
+#include <iostream>
+#include <random>
+#include <opencv2/core/core.hpp>
+#include "../ResidualHighlighter.h"
+#include "../RollingBlockCounter.h"
+
+typedef ResidualHighlighter::Mat1b Mat1b;
+bool good = true;
+
+/**
+ * The reference implementation, which counts each column with a pair of
+ * rolling counters, and recounts after each hit
+ */
+std::vector<cv::Point> referenceFind(Mat1b & mask, int ihw, int ohw) {
+	std::vector<cv::Point> hits;
+	int ihw2 = (ihw - 1) / 2;
+	for (int cx = 0; cx < mask.cols; cx++) {
+		RollingBlockCounter<Mat1b> innerCounter(mask, cx, ihw);
+		RollingBlockCounter<Mat1b> outerCounter(mask, cx, ohw);
+		for (int cy = 0; cy < mask.rows; cy++) {
+			int innerCount = innerCounter(cy);
+			int outerCount = outerCounter(cy);
+			if (innerCount != 0 && innerCount == outerCount) {
+				hits.push_back(cv::Point(cx, cy));
+				cv::Rect innerRect(
+					cv::Point(std::max(cx - ihw2, 0), std::max(cy - ihw2, 0)),
+					cv::Point(std::min(cx + ihw2 + 1, mask.cols),
+						std::min(cy + ihw2 + 1, mask.rows)));
+				mask(innerRect) = 0;
+				innerCounter.purge();
+				outerCounter.purge();
+			}
+		}
+	}
+	return hits;
+}
+
+void testRandom(int seed, int threads, bool innerLarger) {
+	std::mt19937 rng(seed);
+	int width = 1 + rng() % 120;
+	int height = 1 + rng() % 120;
+	int ihw = 1 + rng() % 7;
+	int ohw = ihw + rng() % 25;
+	if (innerLarger) {
+		// The highlighter does not require the outer window to be the larger
+		std::swap(ihw, ohw);
+	}
+	// From very sparse to dense residuals
+	int density = 1 + rng() % 200;
+
+	Mat1b mask(height, width, (unsigned char)0);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			mask(y, x) = (int)(rng() % 1000) < density ? 1 : 0;
+		}
+	}
+	Mat1b referenceMask = mask.clone();
+
+	std::vector<cv::Point> expected = referenceFind(referenceMask, ihw, ohw);
+	ResidualHighlighter highlighter(mask, ihw, ohw, threads);
+	std::vector<cv::Point> actual = highlighter.find();
+
+	bool same = expected == actual;
+	for (int y = 0; y < height && same; y++) {
+		for (int x = 0; x < width; x++) {
+			if (mask(y, x) != referenceMask(y, x)) {
+				same = false;
+				break;
+			}
+		}
+	}
+	if (!same) {
+		std::cout << "Error: seed " << seed << " with " << threads <<
+			" threads: got " << actual.size() << " hits, expected " <<
+			expected.size() << "\n";
+		good = false;
+	}
+}
+
+int main(int argc, char** argv) {
+	for (int seed = 0; seed < 300; seed++) {
+		testRandom(seed, 1, false);
+		testRandom(seed, 4, false);
+		testRandom(seed, 1, true);
+		testRandom(seed, 4, true);
+	}
+	return good ? 0 : 1;
+}
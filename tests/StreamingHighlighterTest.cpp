@@ -0,0 +1,105 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <opencv2/core/core.hpp>
+#include "../ResidualHighlighter.h"
+#include "../StreamingHighlighter.h"
+
+typedef ResidualHighlighter::Mat1b Mat1b;
+bool good = true;
+
+bool columnMajorLess(const cv::Point & a, const cv::Point & b) {
+	return a.x < b.x || (a.x == b.x && a.y < b.y);
+}
+
+/**
+ * Compare the hits with those of ResidualHighlighter. Narrow masks are
+ * taller than the ring, so that rows are reused.
+ */
+void testRandom(int seed, bool narrow) {
+	std::mt19937 rng(seed);
+	int width = narrow ? 1 + rng() % 6 : 1 + rng() % 120;
+	int height = narrow ? 1 + rng() % 600 : 1 + rng() % 120;
+	int ihw = 1 + rng() % 7;
+	int ohw = 1 + rng() % 25;
+	// From very sparse to dense residuals
+	int density = 1 + rng() % 200;
+
+	Mat1b mask(height, width, (unsigned char)0);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			mask(y, x) = (int)(rng() % 1000) < density ? 1 : 0;
+		}
+	}
+
+	StreamingHighlighter streaming(mask.size(), ihw, ohw);
+	std::vector<cv::Point> actual;
+	for (int y = 0; y < height; y++) {
+		std::copy(mask[y], mask[y] + width, streaming.getNextRow());
+		streaming.addRow();
+		streaming.takeHits(actual);
+	}
+	if (streaming.getCompleteRows() != height) {
+		std::cout << "Error: seed " << seed << ": only " <<
+			streaming.getCompleteRows() << " of " << height << " rows complete\n";
+		good = false;
+	}
+	std::sort(actual.begin(), actual.end(), columnMajorLess);
+
+	ResidualHighlighter highlighter(mask, ihw, ohw);
+	std::vector<cv::Point> expected = highlighter.find();
+
+	if (expected != actual) {
+		std::cout << "Error: seed " << seed << (narrow ? " (narrow)" : "") <<
+			": got " << actual.size() << " hits, expected " << expected.size() << "\n";
+		good = false;
+	}
+}
+
+/**
+ * Check that the hits reported as complete do not change as more rows are
+ * added
+ */
+void testComplete(int seed) {
+	std::mt19937 rng(seed);
+	int width = 1 + rng() % 40;
+	int height = 1 + rng() % 300;
+	int density = 1 + rng() % 200;
+	Mat1b mask(height, width, (unsigned char)0);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			mask(y, x) = (int)(rng() % 1000) < density ? 1 : 0;
+		}
+	}
+	Mat1b referenceMask = mask.clone();
+	ResidualHighlighter highlighter(referenceMask, 5, 21);
+	std::vector<cv::Point> expected = highlighter.find();
+
+	StreamingHighlighter streaming(mask.size(), 5, 21);
+	std::vector<cv::Point> actual;
+	for (int y = 0; y < height; y++) {
+		std::copy(mask[y], mask[y] + width, streaming.getNextRow());
+		streaming.addRow();
+		streaming.takeHits(actual);
+		int complete = streaming.getCompleteRows();
+		size_t expectedCount = std::count_if(expected.begin(), expected.end(),
+				[complete](const cv::Point & p) { return p.y < complete; });
+		size_t actualCount = std::count_if(actual.begin(), actual.end(),
+				[complete](const cv::Point & p) { return p.y < complete; });
+		if (expectedCount != actualCount) {
+			std::cout << "Error: seed " << seed << ": " << actualCount <<
+				" hits above row " << complete << ", expected " << expectedCount << "\n";
+			good = false;
+			return;
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	for (int seed = 0; seed < 300; seed++) {
+		testRandom(seed, false);
+		testRandom(seed, true);
+		testComplete(seed);
+	}
+	return good ? 0 : 1;
+}
@@ -0,0 +1,181 @@
+#include <iostream>
+#include <random>
+#include <opencv2/core/core.hpp>
+#include "../SubBlockPainter.h"
+
+typedef SubBlockPainter<int>::MotionField Mat1i;
+typedef SubBlockPainter<int>::Mat3b Mat3b;
+enum {
+	NOT_FOUND = SubBlockPainter<int>::NOT_FOUND,
+	INVALID = SubBlockPainter<int>::INVALID
+};
+bool good = true;
+
+/**
+ * The reference implementation, which rescans the brush at every step. The
+ * only change from the original is the bounds check on srcPos, since the
+ * narrower consensus region when painting left or up allowed the brush to
+ * extend outside the image.
+ */
+class ReferencePainter {
+public:
+	ReferencePainter(Mat1i & motion, const Mat3b & alice, const Mat3b & bob,
+			int brushWidth)
+		: m_motion(motion), m_alice(alice), m_bob(bob), m_brushWidth(brushWidth)
+	{}
+
+	void paint() {
+		for (int y = 0; y < m_motion.rows; y++) {
+			paintSubBlockLine(cv::Point(0, y), cv::Point(1, 0));
+			paintSubBlockLine(cv::Point(m_motion.cols - 1, y), cv::Point(-1, 0));
+		}
+		for (int x = 0; x < m_motion.cols; x++) {
+			paintSubBlockLine(cv::Point(x, 0), cv::Point(0, 1));
+			paintSubBlockLine(cv::Point(x, m_motion.rows - 1), cv::Point(0, -1));
+		}
+	}
+
+private:
+	void paintSubBlockLine(const cv::Point & start, const cv::Point & step) {
+		int halfWidth = (m_brushWidth - 1) / 2;
+		cv::Point brushStep(step.y, step.x);
+		cv::Point halfWidthVector = halfWidth * brushStep;
+		cv::Point pos = start;
+		cv::Rect bounds(cv::Point(), m_motion.size());
+		int prevConsensus = NOT_FOUND;
+		while (bounds.contains(pos)) {
+			cv::Rect roiRect(pos - halfWidthVector, pos + halfWidthVector + cv::Point(1, 1));
+			if ((roiRect & bounds) != roiRect) {
+				break;
+			}
+			Mat1i roiBlock = m_motion(roiRect);
+
+			if (prevConsensus != NOT_FOUND && prevConsensus != INVALID) {
+				int curConsensus = GetWeakConsensus(roiBlock);
+				if (curConsensus == NOT_FOUND || curConsensus == prevConsensus) {
+					for (int b = -halfWidth; b <= halfWidth; b++) {
+						cv::Point srcPos = pos + b * brushStep;
+						cv::Point destPos = srcPos + cv::Point(0, prevConsensus);
+						if (bounds.contains(srcPos) && bounds.contains(destPos)
+							&& m_bob(srcPos) == m_alice(destPos))
+						{
+							m_motion(srcPos) = prevConsensus;
+						}
+					}
+				}
+			}
+
+			prevConsensus = GetStrongConsensus(roiBlock);
+			pos += step;
+		}
+	}
+
+	static int GetStrongConsensus(const Mat1i & block) {
+		int consensus = block(0, 0);
+		for (int y = 0; y < block.rows; y++) {
+			for (int x = 0; x < block.cols; x++) {
+				if (block(y, x) != consensus) {
+					return INVALID;
+				}
+			}
+		}
+		return consensus;
+	}
+
+	static int GetWeakConsensus(const Mat1i & block) {
+		int consensus = NOT_FOUND;
+		for (int y = 0; y < block.rows; y++) {
+			for (int x = 0; x < block.cols; x++) {
+				int v = block(y, x);
+				if (v != consensus && v != NOT_FOUND) {
+					return INVALID;
+				}
+				if (v != NOT_FOUND) {
+					consensus = v;
+				}
+			}
+		}
+		return consensus;
+	}
+
+	Mat1i & m_motion;
+	const Mat3b & m_alice;
+	const Mat3b & m_bob;
+	int m_brushWidth;
+};
+
+/**
+ * Paint a copy of the motion field stored as type T, and compare the result
+ * with the reference
+ */
+template <typename T>
+void comparePainter(const char * typeName, const Mat1i & motion, const Mat1i & expected,
+		const Mat3b & alice, const Mat3b & bob, int brushWidth)
+{
+	typename SubBlockPainter<T>::MotionField actual(motion.size());
+	for (int y = 0; y < motion.rows; y++) {
+		for (int x = 0; x < motion.cols; x++) {
+			int value = motion(y, x);
+			actual(y, x) = value == NOT_FOUND ? SubBlockPainter<T>::NOT_FOUND : value;
+		}
+	}
+	SubBlockPainter<T> painter(actual, alice, bob, brushWidth);
+	painter.paintRows();
+	painter.paintColumns();
+
+	for (int y = 0; y < motion.rows; y++) {
+		for (int x = 0; x < motion.cols; x++) {
+			int value = actual(y, x) == SubBlockPainter<T>::NOT_FOUND ? NOT_FOUND : actual(y, x);
+			if (value != expected(y, x)) {
+				std::cout << "Error: " << typeName << " " << motion.cols << "x" <<
+					motion.rows << " brush " << brushWidth << ": at (" << y << ", " <<
+					x << ") got " << value << ", expected " << expected(y, x) << "\n";
+				good = false;
+				return;
+			}
+		}
+	}
+}
+
+/**
+ * Make a motion field of blocks with a few distinct motions and NOT_FOUND
+ * holes, and images with sparse differences so that painting is sometimes
+ * allowed and sometimes not.
+ */
+void testRandom(std::mt19937 & rng, int width, int height, int brushWidth) {
+	Mat3b alice(height, width), bob(height, width);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			uchar v = rng() % 4 == 0 ? 0 : 255;
+			alice(y, x) = cv::Vec3b(v, v, v);
+			bob(y, x) = rng() % 8 == 0 ? cv::Vec3b(0, 0, 0) : alice(y, x);
+		}
+	}
+	Mat1i motion(height, width);
+	int blockSize = 1 + rng() % 8;
+	for (int y = 0; y < height; y += blockSize) {
+		for (int x = 0; x < width; x += blockSize) {
+			int r = rng() % 6;
+			int value = r < 3 ? NOT_FOUND : r - 4;
+			cv::Rect rect = cv::Rect(x, y, blockSize, blockSize)
+				& cv::Rect(0, 0, width, height);
+			motion(rect) = value;
+		}
+	}
+
+	Mat1i expected = motion.clone();
+	ReferencePainter reference(expected, alice, bob, brushWidth);
+	reference.paint();
+
+	comparePainter<int>("int", motion, expected, alice, bob, brushWidth);
+	comparePainter<int16_t>("int16_t", motion, expected, alice, bob, brushWidth);
+}
+
+int main(int argc, char** argv) {
+	std::mt19937 rng(1);
+	for (int i = 0; i < 200; i++) {
+		testRandom(rng, 1 + rng() % 40, 1 + rng() % 40, 1 + rng() % 10);
+	}
+
+	return good ? 0 : 1;
+}